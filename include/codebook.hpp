@@ -1,5 +1,8 @@
 #pragma once
 
+#include "kmeans.hpp"
+#include "memory_stats.hpp"
+#include "sampler.hpp"
 #include "serialization.hpp"
 
 class CodeBook {
@@ -7,6 +10,26 @@ private:
   cv::Mat codebook, featurebook, labels;
   std::vector<cv::Mat> feature_vectors;
   int num_words{0};
+  KMeans::Params kmeans_params;
+
+  // Training set sampling. With Sampler::ALL every descriptor is used.
+  Sampler::Mode sampling{Sampler::ALL};
+  int max_samples{0};
+  cv::Mat sample_weights;
+
+  // PCA projection applied to the featurebook before clustering. Row 0 holds
+  // the mean, remaining rows the principal components. Empty if disabled.
+  cv::Mat projection;
+  int projection_dims{0};
+
+  // How the descriptors the codebook was trained on were extracted. Taken
+  // from the manifest by generate().
+  SIFT::Features::Settings extraction;
+
+  // Releases training intermediates once they are no longer needed
+  bool low_memory{false};
+  // Bin files read ahead while the current one is processed
+  int prefetch_depth{8};
 
   std::filesystem::path data_path = "";
   std::filesystem::path binary_path = "";
@@ -19,8 +42,15 @@ private:
   // data folder. Given the extension of images in the data folder - will
   // deserialize all the computed features for all images with provided
   // extension. Stack them together into one Mat and store in featurebook.
+  // If sampling is enabled, bin files are streamed through a Sampler and only
+  // the sample is kept.
   void loadFeatureBook_(const std::filesystem::path &image_ext,
                         const std::string &suffix = "");
+  // Reads every bin straight into a featurebook preallocated from the bin
+  // headers, without keeping feature_vectors. Returns false if the bins
+  // cannot be stacked that way or one of them is corrupt.
+  bool readFeatureBook_(const std::filesystem::path &image_ext,
+                        const std::string &suffix);
 
 public:
   CodeBook(const cv::Mat &codebook, const std::filesystem::path &data_path,
@@ -32,17 +62,80 @@ public:
   // Sets the number of words to generate codebook
   void setNumWords(const int &num_words) { this->num_words = num_words; };
 
-  // Generates a new codebook including all images with provided ext
+  // k-means settings. Defaults match the previous cv::kmeans call:
+  // TermCriteria(EPS + COUNT, 10, 1.0), 3 attempts, KMEANS_PP_CENTERS.
+  void setTermCriteria(const cv::TermCriteria &criteria) {
+    kmeans_params.criteria = criteria;
+  };
+  void setAttempts(const int &attempts) { kmeans_params.attempts = attempts; };
+  // cv::KMEANS_PP_CENTERS or cv::KMEANS_RANDOM_CENTERS
+  void setInitialization(const int &flags) { kmeans_params.flags = flags; };
+  // KMeans::HAMERLY gives the same clustering with far fewer distance
+  // computations once clusters settle; worth it for large vocabularies
+  void setAlgorithm(const KMeans::Algorithm &algorithm) {
+    kmeans_params.algorithm = algorithm;
+  };
+
+  // Checkpoints k-means centers to the bin folder every interval iterations.
+  // An interrupted generate() resumes from the last checkpoint when called
+  // again with the same data and settings. 0 disables checkpointing.
+  void setCheckpointInterval(const int &interval) {
+    kmeans_params.checkpoint_interval = interval;
+  };
+
+  // Seeds sampling and k-means initialization. The same seed, data and
+  // settings give a bit-identical codebook on any number of threads.
+  void setSeed(const uint64_t &seed) { kmeans_params.seed = seed; };
+
+  // Trains on at most max_samples descriptors drawn with the given mode
+  // instead of every descriptor of every image
+  void setSampling(const Sampler::Mode &mode, const int &max_samples) {
+    sampling = mode;
+    this->max_samples = max_samples;
+  };
+
+  // Reduces descriptors to dims dimensions with PCA before clustering.
+  // 0 disables the projection.
+  void setProjectionDims(const int &dims) { projection_dims = dims; };
+
+  // In low memory mode the featurebook is read in place without keeping the
+  // per image feature_vectors, and featurebook, labels and sample weights are
+  // released after clustering. Only the codebook is kept.
+  void setLowMemory(const bool &low_memory) { this->low_memory = low_memory; };
+
+  // Number of bin files read ahead on background threads while loading the
+  // featurebook, see Mat::Prefetcher
+  void setPrefetchDepth(const int &depth) { prefetch_depth = depth; };
+
+  // Generates a new codebook including all images with provided ext. Takes
+  // the extraction settings from the manifest of those images.
   void generate(const std::filesystem::path &image_ext,
                 const std::string &suffix = "");
 
-  // Loads codebook from binary_path
+  // Loads codebook from binary_path along with its projection if one was
+  // saved and its extraction settings (default ones if none were saved)
   void load(const std::filesystem::path &name);
 
-  // Saves codebook to binary path
+  // Saves codebook to binary path. The projection, if any, is saved next to
+  // it as <name>_projection.bin and the extraction settings as
+  // <name>_extraction.bin. Removes training checkpoints.
   void save(const std::filesystem::path &name);
 
   // Returns codebook generated for the current instance
   cv::Mat get() const { return codebook; };
-  std::vector<cv::Mat> getFeatureVectors() const { return feature_vectors; };
+  cv::Mat getProjection() const { return projection; };
+  // For codebooks not trained by generate(), e.g. a distributed one
+  void setExtraction(const SIFT::Features::Settings &extraction) {
+    this->extraction = extraction;
+  };
+  const SIFT::Features::Settings &getExtraction() const { return extraction; };
+  // Hash identifying the codebook contents, see KMeans::fingerprint
+  uint64_t getFingerprint() const { return KMeans::fingerprint(codebook); };
+  // Empty in low memory mode
+  const std::vector<cv::Mat> &getFeatureVectors() const {
+    return feature_vectors;
+  };
+
+  // Bytes held by feature_vectors, featurebook, labels and codebook
+  Memory::Usage memoryUsage() const;
 };
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// LZ4-style block codec for bin files. A block is a series of sequences,
+// each a run of literal bytes followed by a copy of earlier output (offset
+// within the last 64KB, at least 4 bytes long). The last sequence has only
+// literals. Descriptor matrices packed to uint8 compress well since most
+// SIFT bins are zero.
+namespace Compression {
+
+// Compresses size bytes of data into a block
+std::string compress(const unsigned char *data, const size_t &size);
+
+// Decompresses block into data, which must hold exactly size bytes. Returns
+// false if the block is corrupt or does not decode to size bytes.
+bool decompress(const std::string &block, unsigned char *data,
+                const size_t &size);
+
+} // namespace Compression
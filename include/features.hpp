@@ -5,16 +5,44 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
 
+#include <filesystem>
+#include <utility>
 #include <vector>
 
 namespace SIFT {
 
 class Features {
+public:
+  // Everything that decides which descriptors an image yields. Stored with
+  // the manifest and the codebook, so queries extract the way the dataset
+  // was extracted.
+  struct Settings {
+    bool root_sift{false};
+    int max_features{0};
+    int grid_rows{1}, grid_cols{1};
+    int read_flags{cv::IMREAD_COLOR};
+    int target_width{0};
+
+    // Descriptors extracted with a different hash are not interchangeable
+    uint64_t hash() const;
+
+    template <class Archive> void serialize(Archive &ar) {
+      ar(root_sift, max_features, grid_rows, grid_cols, read_flags,
+         target_width);
+    };
+  };
+
 private:
   std::vector<cv::KeyPoint> key_points;
   cv::Mat descriptors;
   std::vector<cv::DMatch> good_matches;
 
+  // Scratch buffers reused across calls so that repeated extraction and
+  // matching on one instance does not reallocate
+  cv::Mat resized;
+  std::vector<std::vector<cv::KeyPoint>> cells;
+  std::vector<std::vector<cv::DMatch>> knn_matches;
+
   struct cv::Ptr<cv::SIFT> detectorAndExtractor = cv::SIFT::create();
   struct cv::Ptr<cv::SIFT> detector = cv::SiftFeatureDetector::create();
   struct cv::Ptr<cv::SIFT> feature_extractor =
@@ -23,6 +51,30 @@ private:
   struct cv::Ptr<cv::DescriptorMatcher> matcher =
       cv::DescriptorMatcher::create(cv::DescriptorMatcher::FLANNBASED);
 
+  bool root_sift{false};
+  cv::PCA pca;
+
+  // Keypoint budget. max_features = 0 keeps every detected keypoint.
+  int max_features{0};
+  int grid_rows{1}, grid_cols{1};
+
+  // Extraction resolution. read_flags is passed to cv::imread when reading
+  // from a path; images wider than target_width are downscaled before
+  // extraction. Keypoints are always reported in original image coordinates.
+  int read_flags{cv::IMREAD_COLOR};
+  int target_width{0};
+
+  // Scales keypoint location and size by factor
+  void rescale_(std::vector<cv::KeyPoint> &kpts, const double &factor) const;
+
+  // Keeps the strongest keypoints of every grid cell so that at most
+  // max_features remain, spread across the image
+  void retainBucketed_(std::vector<cv::KeyPoint> &kpts, const cv::Size &size);
+
+  // Keeps the n keypoints with the highest response. Unlike
+  // cv::KeyPointsFilter::retainBest it works in place without allocating.
+  static void retainStrongest_(std::vector<cv::KeyPoint> &kpts, const int &n);
+
 public:
   Features() = default;
   Features(std::vector<cv::KeyPoint> &key_points, cv::Mat &descriptors,
@@ -34,14 +86,66 @@ public:
 
                           const std::vector<cv::KeyPoint> &key_points);
   void detectAndExtract(const cv::Mat &img);
+  // Reads the image with the configured read mode and then extracts
+  void detectAndExtract(const std::filesystem::path &name);
 
   void matchFeatures(const cv::Mat &descriptor1, const cv::Mat &descriptor2);
 
   void findCorrespondences(const cv::Mat &img1, const cv::Mat &img2,
                            const bool show = false);
 
-  auto getKeyPoints() const { return key_points; };
-  auto getDescriptors() const { return descriptors; };
-  auto getMatches() const { return good_matches; };
+  // Flags used to decode images read from a path, e.g. IMREAD_GRAYSCALE or
+  // IMREAD_REDUCED_GRAYSCALE_2. Defaults to IMREAD_COLOR.
+  void setReadMode(const int &flags) { read_flags = flags; };
+
+  // Downscales images wider than width before extraction. 0 disables.
+  void setTargetWidth(const int &width) { target_width = std::max(0, width); };
+
+  // Keeps at most nfeatures keypoints per image, ranked by response.
+  // 0 removes the cap.
+  void setMaxFeatures(const int &nfeatures);
+
+  // Buckets keypoints into a rows x cols grid before ranking so the budget is
+  // spent evenly over the image. Only used together with setMaxFeatures().
+  void setGrid(const int &rows, const int &cols);
+
+  // Applies RootSIFT to every descriptor extracted from now on
+  void setRootSIFT(const bool &root_sift) { this->root_sift = root_sift; };
+
+  // RootSIFT in place: L1 normalizes each CV_32F descriptor and takes the
+  // element-wise square root
+  static void rootSIFT(cv::Mat &des);
+
+  // All of the settings above at once
+  Settings getSettings() const;
+  void setSettings(const Settings &settings);
+
+  // Sets the PCA projection used by project(). Row 0 of projection holds the
+  // mean, the remaining rows hold the principal components.
+  void setProjection(const cv::Mat &projection);
+  // Descriptor width project() expects, 0 if no projection is set
+  int getProjectionCols() const { return pca.mean.cols; };
+
+  // Projects descriptors onto the PCA basis. Returns des untouched if no
+  // projection is set.
+  cv::Mat project(const cv::Mat &des) const;
+  // Same, writing into projected so its buffer can be reused. projected
+  // refers to des if no projection is set.
+  void project(const cv::Mat &des, cv::Mat &projected) const;
+
+  // Learns a dims-D PCA projection from descriptors stacked row-wise
+  static cv::Mat learnProjection(const cv::Mat &descriptors, const int &dims);
+
+  // Results of the last detect/extract/match call. References stay valid
+  // until the next such call on this instance, which reuses the buffers:
+  // clone() or take*() results that must outlive it.
+  const std::vector<cv::KeyPoint> &getKeyPoints() const { return key_points; };
+  const cv::Mat &getDescriptors() const { return descriptors; };
+  const std::vector<cv::DMatch> &getMatches() const { return good_matches; };
+
+  // Move the results out, leaving this instance empty
+  std::vector<cv::KeyPoint> takeKeyPoints() { return std::move(key_points); };
+  cv::Mat takeDescriptors() { return std::move(descriptors); };
+  std::vector<cv::DMatch> takeMatches() { return std::move(good_matches); };
 };
 } // namespace SIFT
\ No newline at end of file
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 64-bit FNV-1a. Used wherever a hash is stored on disk or has to agree
+// across processes and platforms, which std::hash does not guarantee.
+namespace Hash {
+
+const uint64_t fnv1a_offset = 14695981039346656037ULL;
+
+// Hashes size bytes of data. Passing the result of an earlier call as hash
+// continues that hash, so several fields can be chained into one.
+inline uint64_t fnv1a(const void *data, const size_t &size,
+                      uint64_t hash = fnv1a_offset) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i{0}; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline uint64_t fnv1a(const std::string &str,
+                      const uint64_t &hash = fnv1a_offset) {
+  return fnv1a(str.data(), str.size(), hash);
+}
+
+} // namespace Hash
@@ -1,7 +1,10 @@
 #pragma once
 
 #include "codebook.hpp"
+#include "quantizer.hpp"
 #include <map>
+#include <memory>
+#include <mutex>
 
 class HistBook {
 private:
@@ -9,28 +12,106 @@ private:
   std::filesystem::path data_path, binary_path;
 
   int histogram_length;
-  int histbook_size;
 
+  // One version of the tf-idf histbook along with the document frequencies
+  // it was weighted with. Never modified once published: queries keep the
+  // version they started with while a writer builds the next one, and a
+  // version is freed when the last query using it finishes.
+  struct Entry {
+    const std::string *name;
+    const std::vector<double> *hist;
+    double norm;
+  };
+  struct Snapshot {
+    std::map<std::string, std::vector<double>> histbook;
+    std::vector<int> word_occurances;
+    int histbook_size{0};
+    // The images of histbook split by name into shards that are scored in
+    // parallel. Points into histbook, so a Snapshot is never copied.
+    std::vector<std::vector<Entry>> shards;
+    // With setDense(true), histbook as one CV_32F row per image in
+    // dense_names order, each L2 normalized so a batch of queries is scored
+    // with a single GEMM
+    cv::Mat dense;
+    std::vector<const std::string *> dense_names;
+  };
+  // Only read and replaced through std::atomic_load / std::atomic_store
+  std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+  // Taken by everything that changes the histbook. Queries never take it.
+  mutable std::mutex writer_mutex;
+
+  // Writer side state the next version is weighted from
+  int histbook_size{0};
   std::vector<int> word_occurances;
   std::map<std::string, std::vector<int>> histbook_raw;
-  std::map<std::string, std::vector<double>> histbook;
+  int num_shards{1};
+  bool dense{false};
+  bool low_memory{false};
+  int prefetch_depth{8};
 
+  // Holds the projection. Queries extract with a per thread instance set up
+  // from extraction, see extractor_().
   SIFT::Features sift;
-  std::vector<cv::DMatch> matches;
+  SIFT::Features::Settings extraction;
+  // Changes whenever extraction does
+  uint64_t extractor_config{0};
+  Quantizer quantizer;
 
   Mat::Serialization deserialize;
 
   int valid_path = 0;
   int isvalidPath_();
-  std::vector<int> computeHist_(const cv::Mat &des);
+  void newExtractorConfig_();
+  // This thread's SIFT::Features, configured like this HistBook
+  SIFT::Features &extractor_() const;
+  // False (with an error) if the bins of image_ext were extracted with
+  // other settings than extraction
+  bool sameExtraction_(const std::filesystem::path &image_ext) const;
+  void computeHist_(const cv::Mat &des, std::vector<int> &histogram) const;
   // Computes histogram for all images with provided ext before TF-IDF
   void computeHistAll_(const std::filesystem::path &ext,
                        const std::string &suffix = "");
+  // Computes the histograms of the given bin files, replacing earlier ones
+  // and keeping word_occurances up to date
+  void computeHists_(const std::vector<std::filesystem::path> &bin_names);
+  void setHist_(const std::string &name, const cv::Mat &des);
+  // Adds (sign 1) or removes (sign -1) the words of histogram from
+  // word_occurances
+  void countWords_(const std::vector<int> &histogram, const int &sign);
+  // Weights histbook_raw into a new version and publishes it
+  void weightAll_();
+
+  std::shared_ptr<const Snapshot> current_() const {
+    return std::atomic_load(&snapshot);
+  };
+  // Splits next into num_shards shards and makes it the current version
+  void publish_(std::shared_ptr<Snapshot> next);
+  // Publishes a copy of the current version, split again
+  void republish_();
+  static size_t shardOf_(const std::string &name, const size_t &num_shards);
+
+  std::filesystem::path histBookPath_(const std::filesystem::path &name) const;
+  std::filesystem::path shardPath_(const std::filesystem::path &name,
+                                   const int &shard) const;
+  // Writes the whole histbook of snapshot, or only the given shard along
+  // with the total number of images the weights were computed over
+  void writeHistBook_(const std::filesystem::path &path,
+                      const Snapshot &snapshot, const int &shard = -1) const;
+  // Adds the histograms in path to into and sets its document frequencies.
+  // Returns false if path cannot be read, has a different codebook or a row
+  // of the wrong length.
+  bool readHistBook_(const std::filesystem::path &path, Snapshot &into) const;
 
-  std::vector<double> TF_IDF_(const std::vector<int> &hist);
+  static void TF_IDF_(const std::vector<int> &hist, const Snapshot &weights,
+                      std::vector<double> &histogram);
 
-  std::vector<std::string> KNMatcher_(const std::vector<double> &query_hist,
-                                      const int k);
+  // Weights the query and leaves its k closest images in the per thread
+  // scratch. Returns the version ranked against, which the results point
+  // into.
+  std::shared_ptr<const Snapshot> rank_(const std::vector<int> &query_raw,
+                                        const int k) const;
+  std::vector<std::string> KNMatcher_(const std::vector<int> &query_raw,
+                                      const int k) const;
 
 public:
   HistBook(const cv::Mat &codebook, const std::filesystem::path &data_path,
@@ -39,13 +120,54 @@ public:
   explicit HistBook(const std::filesystem::path &data_path,
                     const std::filesystem::path &binary_path = "");
 
-  void loadCodeBook(const std::filesystem::path &name) {
-    codebook = deserialize.deserialize(name);
-  }
+  // Loads codebook from binary_path along with its projection if one was
+  // saved, and extracts query images with the settings saved with it. The
+  // quantizer index is loaded from <name>.flann if present and built
+  // otherwise. Returns false if the codebook has no extraction settings.
+  bool loadCodeBook(const std::filesystem::path &name);
+
+  // Saves the quantizer index built over the codebook to <name>.flann in
+  // binary_path so that loadCodeBook(name) can skip building it
+  void saveIndex(const std::filesystem::path &name) const;
+
+  // Sets the PCA projection the codebook was generated with (see
+  // CodeBook::getProjection). Descriptors are projected before quantization.
+  void setProjection(const cv::Mat &projection) {
+    sift.setProjection(projection);
+  };
+
+  // How query images are extracted, see CodeBook::getExtraction. Set by
+  // loadCodeBook(). generate() and update() refuse bins extracted otherwise.
+  void setExtraction(const SIFT::Features::Settings &extraction);
+  const SIFT::Features::Settings &getExtraction() const { return extraction; };
+
+  // In low memory mode histbook_raw is released during generate() as the
+  // tf-idf histograms are computed. getHistBookRaw() is empty afterwards.
+  void setLowMemory(const bool &low_memory) { this->low_memory = low_memory; };
+
+  // Number of partitions the histbook is split into by image name. Queries
+  // score the partitions in parallel (cv::parallel_for_) and merge their
+  // top k, giving the same matches as a single partition.
+  void setShards(const int &num_shards);
+  int getShards() const { return num_shards; };
+
+  // Also keeps the histbook as a dense matrix for KNScoresBatch, at 4 bytes
+  // per image and word
+  void setDense(const bool &dense);
+
+  // Number of bin files read ahead on background threads during generate(),
+  // see Mat::Prefetcher
+  void setPrefetchDepth(const int &depth) { prefetch_depth = depth; };
 
   // Computes histogram of the image provided, with ref to the codebook
-  std::vector<int> computeHist(const cv::Mat &image);
-  std::vector<int> computeHist(const std::filesystem::path &name);
+  std::vector<int> computeHist(const cv::Mat &image) const;
+  std::vector<int> computeHist(const std::filesystem::path &name) const;
+  // Same, writing into histogram. Reusing one histogram across frames keeps
+  // the per frame path free of allocations in our code; OpenCV's SIFT and
+  // FLANN still allocate internally.
+  void computeHist(const cv::Mat &image, std::vector<int> &histogram) const;
+  void computeHist(const std::filesystem::path &name,
+                   std::vector<int> &histogram) const;
   void generate();
 
   // Displays histogram on terminal window
@@ -57,19 +179,95 @@ public:
   void generate(const std::filesystem::path &image_ext,
                 const std::string &suffix = "");
 
+  // Adds the images (name -> descriptors) to the histbook, replacing images
+  // of the same name, and publishes a new version with refreshed IDF
+  // weights. Queries running meanwhile finish on the previous version.
+  // Needs the raw histograms of every image already in the histbook, i.e.
+  // generate() outside low memory mode or loadRaw(); returns false
+  // otherwise, and also if any descriptors are not CV_32F of the width the
+  // projection or codebook expects. Batching images amortizes re-weighting
+  // the whole histbook.
+  bool insert(const std::map<std::string, cv::Mat> &descriptors);
+
+  // Brings a histbook restored with loadRaw() up to date with the data
+  // folder: recomputes the histograms of the changed bin names and of new
+  // images, drops removed images and weights everything again
+  void update(const std::filesystem::path &image_ext,
+              const std::vector<std::filesystem::path> &changed,
+              const std::string &suffix = "");
+
+  // Saves histbook_raw and word_occurances to <name>_raw.bin in binary_path
+  // so that update() can continue from them. Nothing is left to save after
+  // generate() in low memory mode.
+  void saveRaw(const std::filesystem::path &name) const;
+  // Returns false if there is no raw histbook or it was computed with a
+  // different codebook
+  bool loadRaw(const std::filesystem::path &name);
+
   void save(const std::filesystem::path &name, const std::string &suffix = "");
 
+  // Loads a histbook saved with save(). Refuses (returns an empty map and
+  // keeps the current histbook) if it was saved with a different codebook
+  // or is malformed.
   std::map<std::string, std::vector<double>>
   load(const std::filesystem::path &name, const std::string &suffix = "");
 
-  std::vector<std::string> KNMatcher(const cv::Mat &query_image, const int &k);
+  // Saves each of the getShards() partitions to <name>_shard<i>.txt in
+  // data_path. A shard file holds the document frequencies of the whole
+  // histbook, so a HistBook that load()s only that file ranks its images
+  // with the same scores as the whole histbook. loadShards() reads all of
+  // them back into one histbook.
+  void saveShards(const std::filesystem::path &name);
+  bool loadShards(const std::filesystem::path &name);
+
+  // The query path (computeHist, KNMatcher, KNMatcherDescriptors) only reads
+  // the codebook, the index and the current histbook version and keeps its
+  // scratch per thread, so any number of threads may query one HistBook at
+  // once, also while generate(), update(), insert() or load() publish a new
+  // version. It must not run concurrently with the setters or
+  // loadCodeBook().
+  std::vector<std::string> KNMatcher(const cv::Mat &query_image,
+                                     const int &k) const;
   std::vector<std::string> KNMatcher(const std::filesystem::path &filename,
-                                     const int &k);
+                                     const int &k) const;
+  // Matches descriptors extracted elsewhere, e.g. by a client that runs SIFT
+  // itself. They must be unprojected and use the same RootSIFT setting.
+  std::vector<std::string> KNMatcherDescriptors(const cv::Mat &descriptors,
+                                                const int &k) const;
+  // Ranks a histogram from computeHist(), returning the k closest images
+  // with their cosine distance (0 is best), closest first. Lets results
+  // from HistBooks holding different shards be merged.
+  std::vector<std::pair<std::string, double>>
+  KNScores(const std::vector<int> &histogram, const int &k) const;
+  // KNScores for a batch of histograms. With setDense(true) the batch is
+  // scored against the whole histbook in one cv::gemm call, in single
+  // precision, so near ties may rank differently than in KNScores.
+  std::vector<std::vector<std::pair<std::string, double>>>
+  KNScoresBatch(const std::vector<std::vector<int>> &histograms,
+                const int &k) const;
+  // Descriptors of image extracted like query images, unprojected, e.g. for
+  // insert()
+  cv::Mat extractDescriptors(const cv::Mat &image) const;
+  // Histogram of descriptors extracted elsewhere, see KNMatcherDescriptors
+  void computeHistDescriptors(const cv::Mat &descriptors,
+                              std::vector<int> &histogram) const {
+    computeHist_(descriptors, histogram);
+  };
 
-  std::map<std::string, std::vector<double>> getHistBook() const {
-    return histbook;
+  // Refers to the current version, which is freed once a newer one is
+  // published. Do not hold on to it while other threads write.
+  const std::map<std::string, std::vector<double>> &getHistBook() const {
+    return std::atomic_load(&snapshot)->histbook;
   };
-  std::map<std::string, std::vector<int>> getHistBookRaw() const {
+  const std::map<std::string, std::vector<int>> &getHistBookRaw() const {
     return histbook_raw;
   };
+
+  // Move the histbooks out, leaving this instance without them. KNMatcher
+  // needs the tf-idf histbook, so only take it once matching is done.
+  std::map<std::string, std::vector<double>> takeHistBook();
+  std::map<std::string, std::vector<int>> takeHistBookRaw();
+
+  // Bytes held by histbook_raw, histbook, word_occurances and codebook
+  Memory::Usage memoryUsage() const;
 };
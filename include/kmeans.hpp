@@ -0,0 +1,114 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+// Lloyd k-means over CV_32F rows, used by CodeBook in place of cv::kmeans.
+// The assignment step runs in parallel over rows with SIMD distances, the
+// update step accumulates partial sums per block of rows and reduces them,
+// and attempts run concurrently. HAMERLY keeps per row distance bounds so
+// that rows whose center cannot have changed skip the distance computations;
+// it converges to the same clustering as LLOYD.
+//
+// Results are bit-identical for the same data, params and seed regardless of
+// the number of threads: every row is processed independently and partial
+// sums are reduced in a fixed block order.
+//
+// With a checkpoint path set, each attempt writes its centers and iteration
+// to <checkpoint>_attempt<i>.bin every checkpoint_interval iterations and
+// resumes from that file when fit() is called again on the same data.
+class KMeans {
+public:
+  enum Algorithm { LLOYD, HAMERLY };
+
+  struct Params {
+    int num_clusters{0};
+    cv::TermCriteria criteria{cv::TermCriteria::EPS + cv::TermCriteria::COUNT,
+                              10, 1.0};
+    int attempts{3};
+    // cv::KMEANS_PP_CENTERS or cv::KMEANS_RANDOM_CENTERS
+    int flags{cv::KMEANS_PP_CENTERS};
+    Algorithm algorithm{LLOYD};
+    // Seeds initialization of every attempt. Attempt i uses a seed derived
+    // from (seed, i).
+    uint64_t seed{0};
+    // If set, the first attempt starts from these centers instead of seeding
+    cv::Mat initial_centers;
+
+    std::filesystem::path checkpoint{""};
+    int checkpoint_interval{0};
+  };
+
+private:
+  Params params;
+
+  // Runs a single attempt. Returns its compactness.
+  double run_(const cv::Mat &data, const cv::Mat &weights, cv::Mat &labels,
+              cv::Mat &centers, cv::RNG &rng, const int &attempt,
+              const uint64_t &data_hash) const;
+  double runHamerly_(const cv::Mat &data, const cv::Mat &weights,
+                     cv::Mat &labels, cv::Mat &centers, const int &attempt,
+                     const uint64_t &data_hash, const int &start_iter,
+                     bool converged) const;
+
+  std::filesystem::path checkpointPath_(const int &attempt) const;
+  bool checkpointDue_(const int &iteration) const;
+  // Hash of the params a checkpoint is only valid for, besides the data
+  uint64_t paramsHash_() const;
+  void saveCheckpoint_(const int &attempt, const uint64_t &data_hash,
+                       const cv::Mat &centers, const int &iteration,
+                       const bool &converged) const;
+  // Returns false if there is no readable checkpoint for this attempt, data
+  // and params
+  bool loadCheckpoint_(const int &attempt, const uint64_t &data_hash,
+                       cv::Mat &centers, int &iteration,
+                       bool &converged) const;
+
+  // Sums (weighted) rows per label in fixed blocks and reduces them in block
+  // order
+  static double reduce_(const cv::Mat &data, const cv::Mat &labels,
+                        const cv::Mat &dists, const cv::Mat &weights,
+                        const int &k, cv::Mat &sums, cv::Mat &counts);
+
+  void initPP_(const cv::Mat &data, const cv::Mat &weights, cv::Mat &centers,
+               cv::RNG &rng) const;
+  void initRandom_(const cv::Mat &data, cv::Mat &centers, cv::RNG &rng) const;
+
+public:
+  explicit KMeans(const Params &params) : params{params} {};
+
+  // Clusters the rows of data. Returns the compactness (sum of squared
+  // distances to the assigned centers) of the best attempt. weights, if
+  // given, is a CV_32F column with one weight per row (see Sampler).
+  double fit(const cv::Mat &data, cv::Mat &labels, cv::Mat &centers,
+             const cv::Mat &weights = cv::Mat()) const;
+
+  // Seeds centers from data with the configured initialization, exactly as
+  // the first attempt of fit() would
+  void seedCenters(const cv::Mat &data, cv::Mat &centers,
+                   const cv::Mat &weights = cv::Mat()) const;
+
+  // Assigns every row of data to its nearest center. Writes labels and the
+  // squared distances, and accumulates per cluster sums (CV_64F, k x d) and
+  // counts (CV_64F, k x 1). Returns the compactness.
+  static double accumulate(const cv::Mat &data, const cv::Mat &centers,
+                           cv::Mat &labels, cv::Mat &dists, cv::Mat &sums,
+                           cv::Mat &counts, const cv::Mat &weights = cv::Mat());
+
+  // Removes the checkpoint files of every attempt
+  void removeCheckpoints() const;
+
+  // Derives a well mixed seed for stream i from seed (splitmix64)
+  static uint64_t deriveSeed(const uint64_t &seed, const uint64_t &i);
+
+  // 64-bit FNV-1a hash of the matrix size, type and contents
+  static uint64_t fingerprint(const cv::Mat &mat);
+
+  // Moves centers to the mean of their cluster. Empty clusters keep their
+  // previous center. Returns the largest squared center shift.
+  static double update(const cv::Mat &sums, const cv::Mat &counts,
+                       cv::Mat &centers);
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "features.hpp"
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace Mat {
+
+// Persisted list of the images with one extension in data_path, shared by
+// every stage instead of each one globbing the folder. Stored in the bin
+// folder as manifest_<ext>.bin. refresh() rescans the folder in a single
+// pass and reports which images are new or changed (by size and mtime).
+//
+// Only extraction (preprocess, the pipeline's extract stage) refreshes the
+// manifest. Every other stage reads the saved one as is, so images added or
+// changed in data_path afterwards are not seen until extraction runs again.
+class Manifest {
+public:
+  struct Entry {
+    std::string filename;
+    uint64_t size{0};
+    int64_t mtime{0};
+    // Descriptor rows in the bin file, -1 until recorded with
+    // setDescriptors()
+    int64_t descriptors{-1};
+    // Sum of the recorded descriptor rows of all entries before this one,
+    // i.e. the first row of the image in the stacked featurebook
+    uint64_t offset{0};
+
+    std::string stem() const {
+      return std::filesystem::path(filename).stem().string();
+    };
+
+    template <class Archive> void serialize(Archive &ar) {
+      ar(filename, size, mtime, descriptors, offset);
+    };
+  };
+
+private:
+  std::filesystem::path data_path, binary_path;
+  std::string ext;
+  // Sorted by filename, the order cv::glob returns
+  std::vector<Entry> entries;
+  uint64_t settings{0};
+  SIFT::Features::Settings extraction;
+
+  void updateOffsets_();
+
+public:
+  Manifest(const std::filesystem::path &data_path,
+           const std::filesystem::path &binary_path, const std::string &ext);
+
+  // Loads the saved manifest, scanning the folder and saving the result if
+  // there is none yet. A saved manifest is not rescanned.
+  static Manifest open(const std::filesystem::path &data_path,
+                       const std::filesystem::path &binary_path,
+                       const std::string &ext);
+
+  // File the manifest is saved to
+  std::filesystem::path path() const;
+
+  // Image extensions of every manifest saved in binary_path, sorted
+  static std::vector<std::string>
+  savedExts(const std::filesystem::path &binary_path);
+
+  // Returns false if no manifest was saved for this folder and extension
+  bool load();
+  // Replaces the saved manifest atomically. Prints an error and keeps the
+  // previous file if it cannot be replaced.
+  void save();
+
+  // Rescans data_path. Entries of removed images are dropped, new and
+  // changed images get a fresh entry. Returns the indices of new and changed
+  // entries.
+  std::vector<size_t> refresh();
+
+  void setDescriptors(const size_t &i, const int64_t &rows);
+
+  // Caller defined hash of the settings the bin files were produced with, so
+  // that a settings change can be told apart from unchanged images
+  void setSettings(const uint64_t &settings) { this->settings = settings; };
+  uint64_t getSettings() const { return settings; };
+
+  // Extraction settings of the descriptors in the bin files. CodeBook keeps
+  // them with the codebook it trains on these bins.
+  void setExtraction(const SIFT::Features::Settings &extraction) {
+    this->extraction = extraction;
+  };
+  const SIFT::Features::Settings &getExtraction() const {
+    return extraction;
+  };
+
+  const std::vector<Entry> &getEntries() const { return entries; };
+  size_t size() const { return entries.size(); };
+
+  std::filesystem::path imagePath(const size_t &i) const;
+  // Image stem + suffix of every entry, as used for bin files
+  std::vector<std::filesystem::path>
+  binNames(const std::string &suffix = "") const;
+};
+
+} // namespace Mat
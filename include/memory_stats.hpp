@@ -0,0 +1,103 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Memory accounting for the pipeline. bytes() estimates the heap memory held
+// by the major structures, Stage records wall time and resident set size of a
+// pipeline stage into the process wide Profiler.
+namespace Memory {
+
+using Usage = std::map<std::string, size_t>;
+
+inline size_t bytes(const cv::Mat &mat) {
+  return mat.empty() ? 0 : mat.total() * mat.elemSize();
+}
+
+inline size_t bytes(const std::vector<cv::Mat> &mats) {
+  size_t total = mats.capacity() * sizeof(cv::Mat);
+  for (const auto &mat : mats)
+    total += bytes(mat);
+  return total;
+}
+
+template <class T> size_t bytes(const std::vector<T> &vec) {
+  return vec.capacity() * sizeof(T);
+}
+
+// Includes an estimate of the red-black tree node overhead
+template <class T>
+size_t bytes(const std::map<std::string, std::vector<T>> &map) {
+  size_t total = 0;
+  for (const auto &[key, value] : map)
+    total += 4 * sizeof(void *) + sizeof(key) + key.capacity() +
+             sizeof(value) + bytes(value);
+  return total;
+}
+
+// Resident set size and its high water mark from /proc/self/status
+size_t currentRSS();
+size_t peakRSS();
+
+// Resets the high water mark so the next peakRSS() covers only what follows.
+// Returns false if the kernel does not allow it, in which case peakRSS() is
+// the peak since process start.
+bool resetPeakRSS();
+
+struct StageStats {
+  std::string name;
+  double wall_ms{0.0};
+  size_t rss_before{0}, rss_after{0}, peak_rss{0};
+  bool peak_is_per_stage{false};
+  Usage structures;
+};
+
+class Profiler {
+private:
+  mutable std::mutex mutex;
+  std::vector<StageStats> stages;
+  Profiler() = default;
+
+public:
+  static Profiler &instance();
+
+  void record(const StageStats &stats);
+  std::vector<StageStats> getStages() const;
+  void clear();
+
+  // Human readable table
+  void report(std::ostream &out) const;
+  // Writes all recorded stages as JSON
+  void saveJSON(const std::filesystem::path &path) const;
+};
+
+// Measures the enclosing scope as one stage. Only a stage that starts while
+// no other stage is open resets the peak RSS, and a stage that overlaps
+// another one (nested, or on another thread as in the pipeline) reports
+// peak_is_per_stage = false: its peak covers the other stage as well.
+class Stage {
+private:
+  StageStats stats;
+  std::chrono::steady_clock::time_point start;
+  // Number of stages started before this one, see ~Stage()
+  uint64_t started{0};
+
+public:
+  explicit Stage(const std::string &name);
+  ~Stage();
+  Stage(const Stage &) = delete;
+  Stage &operator=(const Stage &) = delete;
+
+  // Bytes held by structures at the end of the stage
+  void attach(const Usage &structures) { stats.structures = structures; };
+};
+
+} // namespace Memory
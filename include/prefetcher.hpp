@@ -0,0 +1,54 @@
+#pragma once
+
+#include "serialization.hpp"
+
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Mat {
+
+// Reads bin files ahead of the consumer on background threads so that disk
+// I/O overlaps with whatever is done with the previous files. At most depth
+// files are read or held ahead of the last one returned by next(), and the
+// kernel is asked to start reading the files after those (posix_fadvise
+// WILLNEED). Files are returned in the order of names.
+class Prefetcher {
+private:
+  const Serialization serialization;
+  const std::vector<std::filesystem::path> names;
+  const size_t depth;
+
+  std::vector<cv::Mat> slots;
+  std::vector<char> ready;
+  size_t next_load{0}, next_out{0};
+  bool stop{false};
+
+  std::mutex mutex;
+  std::condition_variable loaded, consumed;
+  std::vector<std::thread> readers;
+
+  void read_();
+  // Readahead hint for the bin file of names[i], if there is one
+  void hint_(const size_t &i) const;
+
+public:
+  Prefetcher(const Serialization &serialization,
+             const std::vector<std::filesystem::path> &names,
+             const int &depth = 8, const int &num_threads = 2);
+  ~Prefetcher();
+
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+
+  // Moves the next Mat into mat, waiting for it if it has not been read yet.
+  // Returns false once every file has been returned. A file that could not
+  // be read is returned as an empty Mat.
+  bool next(cv::Mat &mat);
+
+  size_t size() const { return names.size(); };
+};
+
+} // namespace Mat
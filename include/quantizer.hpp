@@ -0,0 +1,59 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/flann.hpp>
+
+#include <filesystem>
+#include <vector>
+
+// Assigns descriptors to codebook words. The kd-tree forest over the codebook
+// is built (or loaded) once and reused for every image and query, instead of
+// being rebuilt by the matcher on each knnMatch call.
+class Quantizer {
+private:
+  cv::Mat codebook;
+  cv::Ptr<cv::flann::Index> index;
+
+  // Same defaults as cv::FlannBasedMatcher
+  int trees{4};
+  int checks{32};
+  float ratio_thresh{0.75f};
+  // Built once instead of per search. Held by pointer since IndexParams
+  // cannot be copied safely.
+  cv::Ptr<cv::flann::SearchParams> search_params =
+      cv::makePtr<cv::flann::SearchParams>(checks);
+
+  static std::filesystem::path
+  fingerprintPath_(const std::filesystem::path &path);
+
+public:
+  Quantizer() = default;
+  explicit Quantizer(const cv::Mat &codebook);
+
+  // Builds the index over the codebook
+  void build(const cv::Mat &codebook);
+
+  // Saves the built index to path. The codebook itself is not stored, only
+  // its fingerprint, in path with ".fingerprint" appended. Returns false if
+  // there is no index or the fingerprint could not be written.
+  bool save(const std::filesystem::path &path) const;
+
+  // Loads an index saved with save() for the given codebook. Returns false if
+  // the file could not be read or was built from a different codebook, in
+  // which case the index is left empty.
+  bool load(const cv::Mat &codebook, const std::filesystem::path &path);
+
+  // Removes an index saved with save() together with its fingerprint
+  static void remove(const std::filesystem::path &path);
+
+  // Matches every descriptor to its nearest word and keeps matches passing
+  // the ratio test. trainIdx of each match is the word index. matches is
+  // cleared first and keeps its capacity. Safe to call from several threads
+  // at once: the index is only searched and the buffers are per thread.
+  void match(const cv::Mat &descriptors,
+             std::vector<cv::DMatch> &matches) const;
+
+  bool empty() const { return index.empty(); };
+  int size() const { return codebook.rows; };
+};
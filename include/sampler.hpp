@@ -0,0 +1,77 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Draws a bounded training set for k-means from descriptors streamed one
+// image at a time, so the full featurebook never has to be held in memory.
+//   UNIFORM    - reservoir sample over all descriptors
+//   STRATIFIED - the same number of descriptors from every image
+//   CORESET    - lightweight coreset (Bachem et al. 2018). Samples descriptors
+//                far from the data mean more often and returns importance
+//                weights. Needs a first pass over the data through addToMean()
+class Sampler {
+public:
+  enum Mode { ALL, UNIFORM, STRATIFIED, CORESET };
+
+private:
+  Mode mode;
+  int max_samples;
+  cv::RNG rng;
+
+  cv::Mat samples;
+  std::vector<float> sample_weights;
+  int64_t seen{0};
+
+  // STRATIFIED
+  int num_images{1};
+
+  // CORESET: first pass statistics and a min-heap of (key, slot) for
+  // weighted reservoir sampling (A-Res)
+  cv::Mat sum;
+  double sum_sqr_norm{0.0};
+  int64_t mean_count{0};
+  cv::Mat mean;
+  double total_sqr_dist{0.0};
+  std::priority_queue<std::pair<double, int>,
+                      std::vector<std::pair<double, int>>,
+                      std::greater<std::pair<double, int>>>
+      heap;
+
+  void store_(const cv::Mat &row, const int &slot);
+  void addUniform_(const cv::Mat &des);
+  void addStratified_(const cv::Mat &des);
+  void addCoreset_(const cv::Mat &des);
+
+public:
+  Sampler(const Mode &mode = ALL, const int &max_samples = 0,
+          const uint64_t &seed = 0x12345678);
+
+  // Number of images add() will be called with. Sets the per image budget
+  // in STRATIFIED mode.
+  void setNumImages(const int &num_images) {
+    this->num_images = std::max(1, num_images);
+  };
+
+  // True if every image has to go through addToMean() before add()
+  bool needsMeanPass() const { return mode == CORESET; };
+  void addToMean(const cv::Mat &des);
+
+  // Offers the descriptors of one image to the sample
+  void add(const cv::Mat &des);
+
+  // Sampled descriptors, one per row
+  cv::Mat get() const;
+
+  // Importance weight of every sampled row (CV_32F column). Empty unless the
+  // mode is CORESET.
+  cv::Mat getWeights() const;
+
+  Mode getMode() const { return mode; };
+};
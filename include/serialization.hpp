@@ -10,6 +10,7 @@
 #include <string>
 
 #include "features.hpp"
+#include "manifest.hpp"
 
 /**
  * Serialisation for OpenCV cv::Mat matrices for the serialisation
@@ -83,12 +84,37 @@ template <class Archive> void load(Archive &ar, cv::Mat &mat) {
 namespace Mat {
 
 class Serialization {
+public:
+  // How serialize(Mat, name) stores matrices.
+  //   RAW     - the cereal cv::Mat layout above, readable by every version
+  //   UINT8   - element values packed into bytes when that is lossless (SIFT
+  //             descriptors are integers in 0-255), RAW otherwise
+  //   FLOAT16 - floating point matrices stored as half floats. Lossy, about
+  //             three significant digits. RootSIFT descriptors are better
+  //             stored as raw SIFT with UINT8, see setRootSIFT()
+  // deserialize() decodes every encoding transparently and returns the
+  // original type.
+  enum Encoding : unsigned char { RAW, UINT8, FLOAT16 };
+
 private:
   std::filesystem::path data_path = "";
   std::filesystem::path binary_path = "";
   int valid_path = 0;
 
+  Encoding encoding{RAW};
+  bool compress{false};
+  bool root_sift{false};
+
   int validPath_();
+  // Encoded bin files start with a negative row count, which the cereal
+  // cv::Mat layout above never writes. Leaves the stream at the start of the
+  // file.
+  static bool isEncoded_(std::istream &file);
+  // Reads a bin file of file_size bytes into mat. The header is checked
+  // against the file size before anything is allocated. Throws if the file
+  // is corrupt, truncated or of an unknown version.
+  static void read_(std::istream &file, const uint64_t &file_size,
+                    cv::Mat &mat);
 
 public:
   Serialization() = default;
@@ -96,9 +122,36 @@ public:
                          const std::filesystem::path &bin_path = "");
   Serialization(const Serialization &) = default; // Copy constructor
 
+  // Encoding used by serialize(). compress additionally packs the encoded
+  // data with the block codec in compression.hpp. Files written with
+  // RAW and no compression keep the cereal cv::Mat layout above.
+  void setEncoding(const Encoding &encoding, const bool &compress = false) {
+    this->encoding = encoding;
+    this->compress = compress;
+  };
+
+  // Marks bins written from now on as raw SIFT descriptors that
+  // deserialize() returns with RootSIFT applied. Raw SIFT values are
+  // integers and store losslessly with UINT8, RootSIFT values only lossily
+  // with FLOAT16.
+  void setRootSIFT(const bool &root_sift) { this->root_sift = root_sift; };
+
   // Serializes - provided Mat file to bin_path
   void serialize(const cv::Mat &m, const std::filesystem::path &name);
 
+  // Hash of how bins of descriptors extracted with extraction are produced:
+  // the extraction settings, the encoding and whether RootSIFT is applied on
+  // read. Stored as the manifest settings, so bins written differently are
+  // extracted again.
+  uint64_t binSettings(const SIFT::Features::Settings &extraction) const;
+
+  // Saves extraction settings to <name>.bin in bin_path. loadExtraction
+  // returns false if there is no such file or it cannot be read.
+  void saveExtraction(const SIFT::Features::Settings &settings,
+                      const std::filesystem::path &name) const;
+  bool loadExtraction(const std::filesystem::path &name,
+                      SIFT::Features::Settings &settings) const;
+
   // Reads a Mat image from data_path and then serializes to bin_path
   // if ext is provided - serializes all images with the extension
   void serialize(const std::filesystem::path &name,
@@ -106,11 +159,37 @@ public:
 
   // Deserializes bin file to Mat
   // name can be full path or just the stem
-  cv::Mat deserialize(const std::filesystem::path &name);
-
-  // Deserializes all the bin files in the binary path if no name is provided.
-  // If ext of the images is provided (eg: .jpg) will return the corresponding
-  // bin file/files.
+  cv::Mat deserialize(const std::filesystem::path &name) const;
+  // Deserializes into mat. If mat already has the stored size and type (e.g.
+  // a row range of a larger Mat) the data is read in place. Returns false
+  // and leaves mat empty if the bin file is missing, corrupt, truncated or of
+  // an unknown version.
+  bool deserialize(const std::filesystem::path &name, cv::Mat &mat) const;
+
+  // Reads only the size and type stored in a bin file
+  bool header(const std::filesystem::path &name, int &rows, int &cols,
+              int &type) const;
+
+  // Full path of the bin file for name
+  std::filesystem::path binPath(const std::filesystem::path &name) const;
+
+  // Returns true if the bin file for name exists in bin_path
+  bool exists(const std::filesystem::path &name) const;
+
+  // Manifest of the images in data_path with the provided extension. Loaded
+  // from the bin folder, or created by scanning data_path the first time.
+  // Call Manifest::refresh() and save() after the image folder changes.
+  Manifest manifest(const std::filesystem::path &ext) const;
+
+  // Returns the bin names (image stem + suffix) of all images in data_path
+  // with the provided extension, as listed in the saved manifest. Images
+  // added since it was last refreshed are not included.
+  std::vector<std::filesystem::path> binNames(const std::filesystem::path &ext,
+                                              const std::string &suffix = "");
+
+  // Deserializes the bin files of every image listed in a saved manifest if
+  // no ext is provided. If ext of the images is provided (eg: .jpg) will
+  // return the corresponding bin file/files.
   std::vector<cv::Mat> deserializeAll(const std::filesystem::path &ext,
                                       const std::string &suffix = "");
 
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "serialization.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <sstream>
+#include <string>
+
+namespace Net {
+
+// Length prefixed messages over a local (AF_UNIX) stream socket. Used to run
+// several processes of the pipeline on one host.
+class Socket {
+private:
+  int fd{-1};
+
+  bool readAll_(char *data, size_t size, const int &timeout_ms);
+  bool writeAll_(const char *data, size_t size);
+
+public:
+  Socket() = default;
+  explicit Socket(const int &fd) : fd{fd} {};
+  Socket(const Socket &) = delete;
+  Socket &operator=(const Socket &) = delete;
+  Socket(Socket &&other) noexcept;
+  Socket &operator=(Socket &&other) noexcept;
+  ~Socket();
+
+  // Binds and listens on path, replacing a stale socket file
+  static Socket listen(const std::filesystem::path &path,
+                       const int &backlog = 16);
+
+  // Connects to path, retrying until timeout_ms has passed
+  static Socket connect(const std::filesystem::path &path,
+                        const int &timeout_ms = 10000);
+
+  // Waits for the next connection. Returns an invalid socket on timeout.
+  Socket accept(const int &timeout_ms = -1);
+
+  // Largest message recv() accepts. A longer length prefix is taken for a
+  // broken or hostile stream and nothing is allocated for it.
+  static const uint64_t max_message_size = uint64_t(1) << 30;
+
+  // Sends / receives one message. recv returns false on timeout, error, a
+  // message over max_message_size or when the peer closed the connection.
+  // timeout_ms < 0 waits forever.
+  bool send(const std::string &message);
+  bool recv(std::string &message, const int &timeout_ms = -1);
+
+  // Waits until a message (or the peer closing) can be read. Returns false
+  // on timeout.
+  bool readable(const int &timeout_ms) const;
+
+  bool valid() const { return fd >= 0; };
+  int get() const { return fd; };
+  void close();
+};
+
+// Serializes values (including cv::Mat) into a message with cereal
+template <class... Args> std::string pack(const Args &...args) {
+  std::ostringstream stream;
+  {
+    cereal::BinaryOutputArchive ar(stream);
+    ar(args...);
+  }
+  return stream.str();
+}
+
+template <class... Args> void unpack(const std::string &message, Args &...args) {
+  std::istringstream stream(message);
+  cereal::BinaryInputArchive ar(stream);
+  ar(args...);
+}
+
+} // namespace Net
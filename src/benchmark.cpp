@@ -0,0 +1,915 @@
+#include "codebook.hpp"
+#include "histbook.hpp"
+#include "kmeans.hpp"
+#include "sampler.hpp"
+#include "serialization.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <string>
+#include <thread>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace fs = std::filesystem;
+
+// Every heap allocation made through operator new is counted so that modes
+// can report allocations per call. cv::Mat buffers come from cv::fastMalloc
+// and are not included.
+namespace {
+std::atomic<size_t> allocation_count{0};
+} // namespace
+
+void *operator new(std::size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size == 0 ? 1 : size))
+    return ptr;
+  throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double elapsedMs(const Clock::time_point &start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// Fraction of images whose closest other image (cosine distance on the
+// tf-idf histograms) lies within window frames of it. Images are assumed to
+// be consecutive frames of a sequence, as in the KITTI data.
+double looAccuracy(const std::map<std::string, std::vector<double>> &histbook,
+                   const int window) {
+  // std::map keeps frames ordered by name
+  std::vector<std::vector<double>> hists;
+  for (const auto &[name, hist] : histbook)
+    hists.emplace_back(hist);
+
+  int correct = 0;
+  for (size_t i{0}; i < hists.size(); i++) {
+    double best = 2.0;
+    size_t best_idx = i;
+    double norm_y = std::sqrt(std::inner_product(
+        hists[i].begin(), hists[i].end(), hists[i].begin(), 0.0));
+    for (size_t j{0}; j < hists.size(); j++) {
+      if (j == i)
+        continue;
+      double norm_x = std::sqrt(std::inner_product(
+          hists[j].begin(), hists[j].end(), hists[j].begin(), 0.0));
+      double dist = 1.0 - std::inner_product(hists[j].begin(), hists[j].end(),
+                                             hists[i].begin(), 0.0) /
+                              (norm_x * norm_y);
+      if (dist < best) {
+        best = dist;
+        best_idx = j;
+      }
+    }
+    long offset = static_cast<long>(best_idx) - static_cast<long>(i);
+    if (best_idx != i && std::abs(offset) <= window)
+      correct++;
+  }
+  return hists.empty() ? 0.0 : static_cast<double>(correct) / hists.size();
+}
+
+struct ExtractionMode {
+  std::string name;
+  int read_flags;
+  int target_width;
+};
+
+// Extracts SIFT for every image with each read mode, builds a small
+// vocabulary on the result and reports extraction time next to retrieval
+// accuracy.
+int benchExtraction(const fs::path &data_path, const std::string &image_ext,
+                    const int num_words) {
+  const std::vector<ExtractionMode> modes{
+      {"colour", cv::IMREAD_COLOR, 0},
+      {"grayscale", cv::IMREAD_GRAYSCALE, 0},
+      {"reduced_2", cv::IMREAD_REDUCED_GRAYSCALE_2, 0},
+      {"reduced_4", cv::IMREAD_REDUCED_GRAYSCALE_4, 0},
+      {"width_640", cv::IMREAD_GRAYSCALE, 640}};
+
+  auto image_path = data_path;
+  (image_path /= "*") += image_ext;
+  std::vector<cv::String> imnames;
+  cv::glob(image_path, imnames, false);
+
+  double baseline_ms = 0.0;
+  std::cout << "mode\textract_ms\tspeedup\tdescriptors\taccuracy" << std::endl;
+  for (const auto &mode : modes) {
+    auto bin_path = data_path;
+    bin_path /= "bench_" + mode.name;
+    fs::create_directories(bin_path);
+    Mat::Serialization serialization(data_path, bin_path);
+
+    SIFT::Features sift;
+    sift.setReadMode(mode.read_flags);
+    sift.setTargetWidth(mode.target_width);
+
+    size_t num_descriptors = 0;
+    auto start = Clock::now();
+    for (const auto &imname : imnames) {
+      fs::path name = imname;
+      sift.detectAndExtract(name);
+      cv::Mat descriptor = sift.getDescriptors();
+      num_descriptors += descriptor.rows;
+      serialization.serialize(descriptor, name.stem());
+    }
+    double extract_ms = elapsedMs(start);
+    if (baseline_ms == 0.0)
+      baseline_ms = extract_ms;
+    Mat::Manifest manifest = serialization.manifest(image_ext);
+    manifest.setExtraction(sift.getSettings());
+    manifest.save();
+
+    CodeBook codebook(data_path, bin_path);
+    codebook.setNumWords(num_words);
+    codebook.generate(image_ext);
+
+    HistBook histbook(codebook.get(), data_path, bin_path);
+    histbook.setExtraction(codebook.getExtraction());
+    histbook.generate(image_ext);
+
+    std::cout << mode.name << "\t" << extract_ms << "\t"
+              << baseline_ms / extract_ms << "\t" << num_descriptors << "\t"
+              << looAccuracy(histbook.getHistBook(), 5) << std::endl;
+  }
+  return 0;
+}
+
+// Clusters synthetic gaussian blobs with Lloyd and Hamerly from the same
+// initial centers and reports the time of each for every k. Both must assign
+// every row to the same center, fails otherwise.
+int benchKMeans(const int rows, const int dims, const std::vector<int> &ks) {
+  cv::RNG rng(12345);
+  const int num_blobs = 256;
+  cv::Mat blob_centers(num_blobs, dims, CV_32F);
+  rng.fill(blob_centers, cv::RNG::UNIFORM, 0.0, 255.0);
+  cv::Mat data(rows, dims, CV_32F);
+  for (int i{0}; i < rows; i++) {
+    cv::Mat row = data.row(i);
+    rng.fill(row, cv::RNG::NORMAL, 0.0, 20.0);
+    row += blob_centers.row(rng.uniform(0, num_blobs));
+  }
+
+  std::cout << "k\tlloyd_ms\thamerly_ms\tspeedup\tcompactness_diff"
+            << "\tlabel_diff" << std::endl;
+  int result = 0;
+  for (const auto &k : ks) {
+    if (k > rows) {
+      std::cout << k << "\tskipped: k exceeds rows" << std::endl;
+      continue;
+    }
+    KMeans::Params params;
+    params.num_clusters = k;
+    params.attempts = 1;
+    params.criteria =
+        cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20,
+                         1e-3);
+
+    cv::Mat lloyd_labels, hamerly_labels, centers;
+    auto start = Clock::now();
+    double lloyd = KMeans(params).fit(data, lloyd_labels, centers);
+    double lloyd_ms = elapsedMs(start);
+
+    params.algorithm = KMeans::HAMERLY; // Same seed, same initial centers
+    start = Clock::now();
+    double hamerly = KMeans(params).fit(data, hamerly_labels, centers);
+    double hamerly_ms = elapsedMs(start);
+
+    const int label_diff = cv::countNonZero(lloyd_labels != hamerly_labels);
+    std::cout << k << "\t" << lloyd_ms << "\t" << hamerly_ms << "\t"
+              << lloyd_ms / hamerly_ms << "\t" << std::abs(lloyd - hamerly)
+              << "\t" << label_diff << std::endl;
+    if (label_diff) {
+      std::cout << "ERROR: Hamerly assigned " << label_diff
+                << " rows differently than Lloyd" << std::endl;
+      result = 1;
+    }
+  }
+  return result;
+}
+
+// Trains codebooks on samples of increasing size and reports the mean
+// squared quantization error on held-out images (every 10th image), which is
+// never part of the sample.
+int benchDistortion(const fs::path &data_path, const std::string &image_ext,
+                    const int num_words, const Sampler::Mode mode,
+                    const std::vector<int> &sample_sizes) {
+  Mat::Serialization serialization(data_path);
+  auto bin_names = serialization.binNames(image_ext);
+  std::vector<fs::path> train_names, held_out_names;
+  for (size_t i{0}; i < bin_names.size(); i++)
+    (i % 10 == 0 ? held_out_names : train_names).emplace_back(bin_names[i]);
+
+  cv::Mat held_out;
+  for (const auto &name : held_out_names)
+    held_out.push_back(serialization.deserialize(name));
+  held_out.convertTo(held_out, CV_32F);
+
+  KMeans::Params params;
+  params.num_clusters = num_words;
+  params.attempts = 1;
+
+  std::cout << "samples\ttrain_ms\theld_out_distortion" << std::endl;
+  for (const auto &size : sample_sizes) {
+    auto start = Clock::now();
+    Sampler sampler(mode, size);
+    sampler.setNumImages(static_cast<int>(train_names.size()));
+    if (sampler.needsMeanPass()) {
+      for (const auto &name : train_names)
+        sampler.addToMean(serialization.deserialize(name));
+    }
+    for (const auto &name : train_names)
+      sampler.add(serialization.deserialize(name));
+
+    cv::Mat labels, centers;
+    if (KMeans(params).fit(sampler.get(), labels, centers,
+                           sampler.getWeights()) < 0)
+      return 1;
+    double train_ms = elapsedMs(start);
+
+    cv::Mat dists, sums, counts;
+    double distortion =
+        KMeans::accumulate(held_out, centers, labels, dists, sums, counts);
+    std::cout << size << "\t" << train_ms << "\t"
+              << distortion / std::max(1, held_out.rows) << std::endl;
+  }
+  return 0;
+}
+
+struct CallStats {
+  double allocations;
+  double ms;
+};
+
+// Average allocations and time of one call to f
+template <class F> CallStats perCall(const int iterations, F &&f) {
+  const size_t allocations = allocation_count.load();
+  auto start = Clock::now();
+  for (int i{0}; i < iterations; i++)
+    f();
+  double ms = elapsedMs(start);
+  return {static_cast<double>(allocation_count.load() - allocations) /
+              iterations,
+          ms / iterations};
+}
+
+void printStats(const std::string &name, const CallStats &copy,
+                const CallStats &ref) {
+  std::cout << name << "\t" << copy.allocations << "\t" << ref.allocations
+            << "\t" << copy.ms << "\t" << ref.ms << std::endl;
+}
+
+// Reads the results of HistBook and SIFT::Features the way a caller like
+// main.cpp does, once through a copy (what the accessors used to return)
+// and once through the const reference they return now.
+int benchAccessors(const fs::path &data_path, const std::string &image_ext,
+                   const int iterations) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+  histbook.load("histbook");
+
+  auto image_path = data_path;
+  (image_path /= "*") += image_ext;
+  std::vector<cv::String> imnames;
+  cv::glob(image_path, imnames, false);
+  if (imnames.empty() || histbook.getHistBook().empty()) {
+    std::cout << "ERROR: No images or histbook in " << data_path << std::endl;
+    return 1;
+  }
+  SIFT::Features sift;
+  sift.detectAndExtract(fs::path(imnames.front()));
+
+  // Touch the data so the reads cannot be optimized away
+  double checksum = 0.0;
+  auto sumHistBook = [&checksum](const auto &book) {
+    for (const auto &[name, hist] : book)
+      checksum += hist.front();
+  };
+  auto sumKeyPoints = [&checksum](const auto &kpts) {
+    for (const auto &kpt : kpts)
+      checksum += kpt.response;
+  };
+
+  std::cout << "accessor\tcopy_allocs\tref_allocs\tcopy_ms\tref_ms"
+            << std::endl;
+  printStats("getHistBook", perCall(iterations, [&] {
+               std::map<std::string, std::vector<double>> book =
+                   histbook.getHistBook();
+               sumHistBook(book);
+             }),
+             perCall(iterations, [&] { sumHistBook(histbook.getHistBook()); }));
+  printStats("getKeyPoints", perCall(iterations, [&] {
+               std::vector<cv::KeyPoint> kpts = sift.getKeyPoints();
+               sumKeyPoints(kpts);
+             }),
+             perCall(iterations, [&] { sumKeyPoints(sift.getKeyPoints()); }));
+  std::cout << "checksum " << checksum << std::endl;
+  return 0;
+}
+
+// Computes histograms for a sequence of frames held in memory, once through
+// computeHist returning a fresh histogram and once reusing one histogram and
+// the per thread scratch buffers. The first pass over the frames warms the
+// buffers up and is not counted. After it, every frame must allocate the
+// same number of times on each further pass of the reused path: what is left
+// comes from inside OpenCV's SIFT and FLANN, which depends on the image but
+// must not grow. Also fails if the reused path allocates more than
+// max_allocs per frame, unless max_allocs is negative.
+int measureFrames(const HistBook &histbook, const std::vector<cv::Mat> &frames,
+                  const int num_frames, const double max_allocs) {
+  std::vector<int> histogram;
+  for (const auto &frame : frames)
+    histbook.computeHist(frame, histogram);
+
+  size_t frame = 0;
+  long checksum = 0;
+  CallStats fresh = perCall(num_frames, [&] {
+    std::vector<int> hist =
+        histbook.computeHist(frames[frame++ % frames.size()]);
+    checksum += hist.front();
+  });
+  CallStats reused = perCall(num_frames, [&] {
+    histbook.computeHist(frames[frame++ % frames.size()], histogram);
+    checksum += histogram.front();
+  });
+
+  std::cout << "path\tallocs_per_frame\tms_per_frame\n"
+            << "fresh\t" << fresh.allocations << "\t" << fresh.ms << "\n"
+            << "reused\t" << reused.allocations << "\t" << reused.ms
+            << std::endl;
+  std::cout << "checksum " << checksum << std::endl;
+
+  // Allocations of each frame in the first of these passes
+  const int passes = std::max(2, num_frames / static_cast<int>(frames.size()));
+  std::vector<size_t> baseline(frames.size());
+  int unsteady = 0;
+  for (int pass{0}; pass < passes; pass++) {
+    for (size_t i{0}; i < frames.size(); i++) {
+      const size_t before = allocation_count.load();
+      histbook.computeHist(frames[i], histogram);
+      const size_t allocations = allocation_count.load() - before;
+      if (pass == 0)
+        baseline[i] = allocations;
+      else if (allocations != baseline[i])
+        unsteady++;
+    }
+  }
+
+  int result = 0;
+  if (unsteady) {
+    std::cout << "ERROR: " << unsteady << " of " << (passes - 1) * frames.size()
+              << " repeated frames allocated a different number of times"
+              << std::endl;
+    result = 1;
+  }
+  if (max_allocs >= 0 && reused.allocations > max_allocs) {
+    std::cout << "ERROR: " << reused.allocations
+              << " allocations per frame on the reused path, limit "
+              << max_allocs << std::endl;
+    result = 1;
+  }
+  return result;
+}
+
+int benchFrame(const fs::path &data_path, const std::string &image_ext,
+               const int num_frames, const double max_allocs) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+
+  auto image_path = data_path;
+  (image_path /= "*") += image_ext;
+  std::vector<cv::String> imnames;
+  cv::glob(image_path, imnames, false);
+  std::vector<cv::Mat> frames;
+  for (size_t i{0}; i < imnames.size() && frames.size() < 16; i++)
+    frames.emplace_back(cv::imread(imnames.at(i), cv::IMREAD_GRAYSCALE));
+  if (frames.empty()) {
+    std::cout << "ERROR: No images in " << data_path << std::endl;
+    return 1;
+  }
+  return measureFrames(histbook, frames, num_frames, max_allocs);
+}
+
+// The frame mode without a dataset, run by ctest: smoothed random images and
+// a codebook picked from their own descriptors, in a temporary folder.
+// OpenCV runs single threaded so the counts do not depend on scheduling.
+int benchFrameSynthetic(const int num_frames) {
+  const fs::path data_path = fs::temp_directory_path() / "bovw_frame_test";
+  fs::create_directories(data_path / "bin");
+
+  cv::RNG rng(12345);
+  std::vector<cv::Mat> frames;
+  for (int i{0}; i < 8; i++) {
+    cv::Mat noise(48, 64, CV_8U), frame;
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+    cv::resize(noise, frame, cv::Size(320, 240), 0, 0, cv::INTER_CUBIC);
+    frames.emplace_back(frame);
+  }
+
+  SIFT::Features sift;
+  cv::Mat descriptors;
+  for (const auto &frame : frames) {
+    sift.detectAndExtract(frame);
+    descriptors.push_back(sift.getDescriptors());
+  }
+  const int num_words = 32;
+  if (descriptors.rows < num_words) {
+    std::cout << "ERROR: Only " << descriptors.rows
+              << " descriptors in the synthetic frames" << std::endl;
+    fs::remove_all(data_path);
+    return 1;
+  }
+  descriptors.convertTo(descriptors, CV_32F);
+  cv::Mat codebook;
+  for (int i{0}; i < num_words; i++)
+    codebook.push_back(descriptors.row(i * (descriptors.rows / num_words)));
+
+  HistBook histbook(codebook, data_path);
+  histbook.setExtraction(sift.getSettings());
+  const int threads = cv::getNumThreads();
+  cv::setNumThreads(1);
+  const int result = measureFrames(histbook, frames, num_frames, -1.0);
+  cv::setNumThreads(threads);
+  fs::remove_all(data_path);
+  return result;
+}
+
+// Queries one HistBook from several threads at once. Every thread must get
+// the same matches as a single threaded run; reports queries per second for
+// each thread count.
+int benchConcurrent(const fs::path &data_path, const std::string &image_ext,
+                    const int num_queries, const std::vector<int> &threads) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+  histbook.load("histbook");
+
+  auto image_path = data_path;
+  (image_path /= "*") += image_ext;
+  std::vector<cv::String> imnames;
+  cv::glob(image_path, imnames, false);
+  std::vector<cv::Mat> frames;
+  for (size_t i{0}; i < imnames.size() && frames.size() < 16; i++)
+    frames.emplace_back(cv::imread(imnames.at(i), cv::IMREAD_GRAYSCALE));
+  if (frames.empty() || histbook.getHistBook().empty()) {
+    std::cout << "ERROR: No images or histbook in " << data_path << std::endl;
+    return 1;
+  }
+
+  const int k = 10;
+  std::vector<std::vector<std::string>> expected;
+  for (const auto &frame : frames)
+    expected.emplace_back(histbook.KNMatcher(frame, k));
+
+  std::cout << "threads\tqueries_per_s\tmismatches" << std::endl;
+  for (const auto &num_threads : threads) {
+    std::atomic<int> next{0}, mismatches{0};
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (int t{0}; t < num_threads; t++) {
+      workers.emplace_back([&] {
+        for (int i = next++; i < num_queries; i = next++) {
+          const size_t frame = i % frames.size();
+          if (histbook.KNMatcher(frames.at(frame), k) != expected.at(frame))
+            mismatches++;
+        }
+      });
+    }
+    for (auto &worker : workers)
+      worker.join();
+    const double ms = elapsedMs(start);
+    std::cout << num_threads << "\t" << num_queries * 1000.0 / ms << "\t"
+              << mismatches << std::endl;
+    if (mismatches)
+      return 1;
+  }
+  return 0;
+}
+
+// Query latency percentiles in ms
+void printLatency(const std::string &name, std::vector<double> &latencies) {
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](const double &p) {
+    return latencies.at(static_cast<size_t>(p * (latencies.size() - 1)));
+  };
+  std::cout << name << "\t" << latencies.size() << "\t" << percentile(0.5)
+            << "\t" << percentile(0.99) << std::endl;
+}
+
+// Query latency on an idle histbook and while a writer inserts the second
+// half of the images in batches. Queries run on the published version, so
+// the two should be close apart from the CPU the writer takes.
+int benchIngest(const fs::path &data_path, const std::string &image_ext,
+                const int batch_size, const int num_threads) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+
+  Mat::Serialization serialization(data_path);
+  const auto bin_names = serialization.binNames(image_ext);
+  std::vector<std::map<std::string, cv::Mat>> batches(1);
+  for (size_t i{0}; i < bin_names.size(); i++) {
+    if (i > bin_names.size() / 2 &&
+        batches.back().size() >= static_cast<size_t>(batch_size))
+      batches.emplace_back();
+    batches.back()[bin_names.at(i).string()] =
+        serialization.deserialize(bin_names.at(i));
+  }
+  if (batches.size() < 2) {
+    std::cout << "ERROR: Not enough images in " << data_path << std::endl;
+    return 1;
+  }
+  histbook.insert(batches.front());
+
+  std::vector<cv::Mat> queries;
+  for (const auto &[name, descriptors] : batches.front()) {
+    queries.emplace_back(descriptors);
+    if (queries.size() == 16)
+      break;
+  }
+
+  // Queries until done is set, recording the latency of each per thread
+  auto runQueries = [&](std::atomic<bool> &done,
+                        std::vector<std::vector<double>> &latencies) {
+    latencies.assign(num_threads, {});
+    std::vector<std::thread> workers;
+    for (int t{0}; t < num_threads; t++) {
+      workers.emplace_back([&, t] {
+        for (size_t i{0}; !done || latencies.at(t).size() < 10; i++) {
+          auto start = Clock::now();
+          histbook.KNMatcherDescriptors(queries.at(i % queries.size()), 10);
+          latencies.at(t).emplace_back(elapsedMs(start));
+        }
+      });
+    }
+    return workers;
+  };
+  auto collect = [](const std::vector<std::vector<double>> &latencies) {
+    std::vector<double> all;
+    for (const auto &thread : latencies)
+      all.insert(all.end(), thread.begin(), thread.end());
+    return all;
+  };
+
+  std::cout << "phase\tqueries\tp50_ms\tp99_ms" << std::endl;
+  std::vector<std::vector<double>> latencies;
+  std::atomic<bool> idle_done{false};
+  auto workers = runQueries(idle_done, latencies);
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  idle_done = true;
+  for (auto &worker : workers)
+    worker.join();
+  auto idle = collect(latencies);
+  printLatency("idle", idle);
+
+  std::atomic<bool> done{false};
+  workers = runQueries(done, latencies);
+  auto start = Clock::now();
+  size_t inserted = 0;
+  for (size_t i{1}; i < batches.size(); i++) {
+    histbook.insert(batches.at(i));
+    inserted += batches.at(i).size();
+  }
+  const double insert_ms = elapsedMs(start);
+  done = true;
+  for (auto &worker : workers)
+    worker.join();
+  auto ingest = collect(latencies);
+  printLatency("ingest", ingest);
+  std::cout << "inserted " << inserted << " images in " << insert_ms << " ms"
+            << std::endl;
+  return 0;
+}
+
+// Query time for each number of shards. Every sharding must give the
+// matches of the unsharded histbook, also after a round trip through
+// saveShards / loadShards.
+int benchShards(const fs::path &data_path, const std::string &image_ext,
+                const int num_queries, const std::vector<int> &shard_counts) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+  histbook.load("histbook");
+
+  Mat::Serialization serialization(data_path);
+  const auto bin_names = serialization.binNames(image_ext);
+  std::vector<cv::Mat> queries;
+  for (size_t i{0}; i < bin_names.size() && queries.size() < 16; i++)
+    queries.emplace_back(serialization.deserialize(bin_names.at(i)));
+  if (queries.empty() || histbook.getHistBook().empty()) {
+    std::cout << "ERROR: No bins or histbook in " << data_path << std::endl;
+    return 1;
+  }
+
+  const int k = 10;
+  histbook.setShards(1);
+  std::vector<std::vector<std::string>> expected;
+  for (const auto &query : queries)
+    expected.emplace_back(histbook.KNMatcherDescriptors(query, k));
+
+  int mismatches = 0;
+  std::cout << "shards\tms_per_query\tmismatches" << std::endl;
+  for (const auto &num_shards : shard_counts) {
+    histbook.setShards(num_shards);
+    int query = 0;
+    CallStats stats = perCall(num_queries, [&] {
+      const size_t i = query++ % queries.size();
+      if (histbook.KNMatcherDescriptors(queries.at(i), k) != expected.at(i))
+        mismatches++;
+    });
+    std::cout << num_shards << "\t" << stats.ms << "\t" << mismatches
+              << std::endl;
+  }
+
+  histbook.saveShards("bench_shards");
+  HistBook reloaded(data_path);
+  if (!reloaded.loadCodeBook("codebook") ||
+      !reloaded.loadShards("bench_shards"))
+    return 1;
+  for (size_t i{0}; i < queries.size(); i++) {
+    if (reloaded.KNMatcherDescriptors(queries.at(i), k) != expected.at(i))
+      mismatches++;
+  }
+  std::cout << "reloaded mismatches " << mismatches << std::endl;
+  return mismatches ? 1 : 0;
+}
+
+// Scores batches of query histograms against the histbook with the scalar
+// loop (KNScores per query) and with one GEMM per batch (KNScoresBatch on
+// the dense histbook). GFLOP/s counts the multiply-adds of the scoring
+// itself; agreement is the fraction of queries with the same top k.
+int benchGemm(const fs::path &data_path, const std::string &image_ext,
+              const int num_queries, const std::vector<int> &batch_sizes) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+  histbook.load("histbook");
+
+  Mat::Serialization serialization(data_path);
+  const auto bin_names = serialization.binNames(image_ext);
+  std::vector<std::vector<int>> histograms;
+  for (size_t i{0}; i < bin_names.size() && histograms.size() < 64; i++) {
+    histograms.emplace_back();
+    histbook.computeHistDescriptors(serialization.deserialize(bin_names.at(i)),
+                                    histograms.back());
+  }
+  const auto &book = histbook.getHistBook();
+  if (histograms.empty() || book.empty()) {
+    std::cout << "ERROR: No bins or histbook in " << data_path << std::endl;
+    return 1;
+  }
+  const double flops_per_query =
+      2.0 * book.size() * book.begin()->second.size();
+
+  // Reference results of every histogram, also when there are fewer
+  // queries than histograms
+  const int k = 10;
+  std::vector<std::vector<std::pair<std::string, double>>> expected;
+  for (const auto &histogram : histograms)
+    expected.emplace_back(histbook.KNScores(histogram, k));
+
+  auto start = Clock::now();
+  for (int i{0}; i < num_queries; i++)
+    histbook.KNScores(histograms.at(i % histograms.size()), k);
+  double ms = elapsedMs(start);
+  std::cout << "path\tbatch\tms_per_query\tgflops\tagreement" << std::endl;
+  std::cout << "loop\t1\t" << ms / num_queries << "\t"
+            << flops_per_query * num_queries / ms / 1e6 << "\t1" << std::endl;
+
+  histbook.setDense(true);
+  for (const auto &batch_size : batch_sizes) {
+    std::vector<std::vector<int>> batch(batch_size);
+    int agreeing = 0, compared = 0;
+    start = Clock::now();
+    for (int done{0}; done < num_queries; done += batch_size) {
+      for (int i{0}; i < batch_size; i++)
+        batch.at(i) = histograms.at((done + i) % histograms.size());
+      const auto results = histbook.KNScoresBatch(batch, k);
+      for (int i{0}; i < batch_size; i++) {
+        const auto &reference = expected.at((done + i) % histograms.size());
+        bool same = results.at(i).size() == reference.size();
+        for (size_t j{0}; same && j < reference.size(); j++)
+          same = results.at(i).at(j).first == reference.at(j).first;
+        agreeing += same;
+        compared++;
+      }
+    }
+    ms = elapsedMs(start);
+    std::cout << "gemm\t" << batch_size << "\t" << ms / compared << "\t"
+              << flops_per_query * compared / ms / 1e6 << "\t"
+              << static_cast<double>(agreeing) / compared << std::endl;
+  }
+  return 0;
+}
+
+struct StorageMode {
+  std::string name;
+  Mat::Serialization::Encoding encoding;
+  bool compress;
+};
+
+// Rewrites the descriptor bins of every image with each encoding and
+// reports the bin folder size, the time to read it back and the largest
+// error against the original descriptors.
+int benchStorage(const fs::path &data_path, const std::string &image_ext) {
+  const std::vector<StorageMode> modes{
+      {"raw", Mat::Serialization::RAW, false},
+      {"raw_lz", Mat::Serialization::RAW, true},
+      {"uint8", Mat::Serialization::UINT8, false},
+      {"uint8_lz", Mat::Serialization::UINT8, true},
+      {"float16", Mat::Serialization::FLOAT16, false},
+      {"float16_lz", Mat::Serialization::FLOAT16, true}};
+
+  Mat::Serialization source(data_path);
+  const auto bin_names = source.binNames(image_ext);
+  std::vector<cv::Mat> descriptors;
+  for (const auto &name : bin_names)
+    descriptors.emplace_back(source.deserialize(name));
+
+  uintmax_t raw_bytes = 0;
+  std::cout << "mode\tbytes\tratio\tread_ms\tmax_error" << std::endl;
+  for (const auto &mode : modes) {
+    auto bin_path = data_path;
+    bin_path /= "bench_storage_" + mode.name;
+    fs::create_directories(bin_path);
+    Mat::Serialization serialization(data_path, bin_path);
+    serialization.setEncoding(mode.encoding, mode.compress);
+
+    uintmax_t bytes = 0;
+    for (size_t i{0}; i < bin_names.size(); i++) {
+      serialization.serialize(descriptors.at(i), bin_names.at(i));
+      bytes += fs::file_size(serialization.binPath(bin_names.at(i)));
+    }
+    if (raw_bytes == 0)
+      raw_bytes = bytes;
+
+    double max_error = 0.0;
+    cv::Mat loaded;
+    auto start = Clock::now();
+    for (size_t i{0}; i < bin_names.size(); i++) {
+      serialization.deserialize(bin_names.at(i), loaded);
+      if (!descriptors.at(i).empty())
+        max_error = std::max(
+            max_error, cv::norm(descriptors.at(i), loaded, cv::NORM_INF));
+    }
+    double read_ms = elapsedMs(start);
+
+    std::cout << mode.name << "\t" << bytes << "\t"
+              << static_cast<double>(raw_bytes) / std::max<uintmax_t>(1, bytes)
+              << "\t" << read_ms << "\t" << max_error << std::endl;
+  }
+  return 0;
+}
+
+void usage() {
+  std::cout << "Usage: benchmark extraction <data_path> [ext] [num_words]\n"
+               "       benchmark kmeans [rows] [dims] [k ...]\n"
+               "       benchmark distortion <data_path> <ext> <num_words> "
+               "<uniform|stratified|coreset> <samples ...>\n"
+               "       benchmark accessors <data_path> [ext] [iterations]\n"
+               "       benchmark frame <data_path> [ext] [frames] "
+               "[max_allocs]\n"
+               "       benchmark frame-test [frames]\n"
+               "       benchmark storage <data_path> [ext]\n"
+               "       benchmark concurrent <data_path> [ext] [queries] "
+               "[threads ...]\n"
+               "       benchmark ingest <data_path> [ext] [batch] [threads]\n"
+               "       benchmark shards <data_path> [ext] [queries] "
+               "[shards ...]\n"
+               "       benchmark gemm <data_path> [ext] [queries] "
+               "[batch ...]"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  const std::string mode = argv[1];
+
+  if (mode == "extraction" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string image_ext = argc > 3 ? argv[3] : ".png";
+    const int num_words = argc > 4 ? std::stoi(argv[4]) : 200;
+    return benchExtraction(data_path, image_ext, num_words);
+  }
+
+  if (mode == "kmeans") {
+    const int rows = argc > 2 ? std::stoi(argv[2]) : 200000;
+    const int dims = argc > 3 ? std::stoi(argv[3]) : 64;
+    std::vector<int> ks;
+    for (int i{4}; i < argc; i++)
+      ks.emplace_back(std::stoi(argv[i]));
+    if (ks.empty())
+      ks = {1000, 10000, 100000};
+    return benchKMeans(rows, dims, ks);
+  }
+
+  if (mode == "distortion" && argc > 6) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string sampling = argv[5];
+    Sampler::Mode sampler_mode = Sampler::UNIFORM;
+    if (sampling == "stratified")
+      sampler_mode = Sampler::STRATIFIED;
+    else if (sampling == "coreset")
+      sampler_mode = Sampler::CORESET;
+    std::vector<int> sample_sizes;
+    for (int i{6}; i < argc; i++)
+      sample_sizes.emplace_back(std::stoi(argv[i]));
+    return benchDistortion(data_path, argv[3], std::stoi(argv[4]),
+                           sampler_mode, sample_sizes);
+  }
+
+  if (mode == "accessors" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string image_ext = argc > 3 ? argv[3] : ".png";
+    const int iterations = argc > 4 ? std::stoi(argv[4]) : 100;
+    return benchAccessors(data_path, image_ext, std::max(1, iterations));
+  }
+
+  if (mode == "frame" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string image_ext = argc > 3 ? argv[3] : ".png";
+    const int num_frames = argc > 4 ? std::stoi(argv[4]) : 100;
+    const double max_allocs = argc > 5 ? std::stod(argv[5]) : -1.0;
+    return benchFrame(data_path, image_ext, std::max(1, num_frames),
+                      max_allocs);
+  }
+
+  if (mode == "frame-test")
+    return benchFrameSynthetic(std::max(1, argc > 2 ? std::stoi(argv[2]) : 32));
+
+  if (mode == "storage" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    return benchStorage(data_path, argc > 3 ? argv[3] : ".png");
+  }
+
+  if (mode == "concurrent" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string image_ext = argc > 3 ? argv[3] : ".png";
+    const int num_queries = argc > 4 ? std::stoi(argv[4]) : 200;
+    std::vector<int> threads;
+    for (int i{5}; i < argc; i++)
+      threads.emplace_back(std::max(1, std::stoi(argv[i])));
+    if (threads.empty())
+      threads = {1, 2, 4, 8};
+    return benchConcurrent(data_path, image_ext, std::max(1, num_queries),
+                           threads);
+  }
+
+  if (mode == "ingest" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string image_ext = argc > 3 ? argv[3] : ".png";
+    const int batch_size = argc > 4 ? std::stoi(argv[4]) : 50;
+    const int num_threads = argc > 5 ? std::stoi(argv[5]) : 2;
+    return benchIngest(data_path, image_ext, std::max(1, batch_size),
+                       std::max(1, num_threads));
+  }
+
+  if (mode == "shards" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string image_ext = argc > 3 ? argv[3] : ".png";
+    const int num_queries = argc > 4 ? std::stoi(argv[4]) : 200;
+    std::vector<int> shard_counts;
+    for (int i{5}; i < argc; i++)
+      shard_counts.emplace_back(std::max(1, std::stoi(argv[i])));
+    if (shard_counts.empty())
+      shard_counts = {1, 2, 4, 8};
+    return benchShards(data_path, image_ext, std::max(1, num_queries),
+                       shard_counts);
+  }
+
+  if (mode == "gemm" && argc > 2) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const std::string image_ext = argc > 3 ? argv[3] : ".png";
+    const int num_queries = argc > 4 ? std::stoi(argv[4]) : 256;
+    std::vector<int> batch_sizes;
+    for (int i{5}; i < argc; i++)
+      batch_sizes.emplace_back(std::max(1, std::stoi(argv[i])));
+    if (batch_sizes.empty())
+      batch_sizes = {1, 8, 32, 128};
+    return benchGemm(data_path, image_ext, std::max(1, num_queries),
+                     batch_sizes);
+  }
+
+  usage();
+  return 1;
+}
@@ -1,4 +1,6 @@
 #include "codebook.hpp"
+#include "prefetcher.hpp"
+#include "quantizer.hpp"
 
 CodeBook::CodeBook(const cv::Mat &codebook,
                    const std::filesystem::path &data_path,
@@ -32,11 +34,80 @@ int CodeBook::validPath_() {
 
 void CodeBook::loadFeatureBook_(const std::filesystem::path &image_ext,
                                 const std::string &suffix) {
-  feature_vectors = serialization.deserializeAll(image_ext, suffix);
-  featurebook = feature_vectors.at(0);
-  for (size_t i{1}; i < feature_vectors.size(); i++) {
-    cv::vconcat(featurebook, feature_vectors.at(i), featurebook);
+  if (sampling != Sampler::ALL) {
+    auto bin_names = serialization.binNames(image_ext, suffix);
+    Sampler sampler(sampling, max_samples,
+                    KMeans::deriveSeed(kmeans_params.seed, 0xC0DEB00C));
+    sampler.setNumImages(static_cast<int>(bin_names.size()));
+    cv::Mat descriptors;
+    if (sampler.needsMeanPass()) {
+      Mat::Prefetcher prefetcher(serialization, bin_names, prefetch_depth);
+      while (prefetcher.next(descriptors))
+        sampler.addToMean(descriptors);
+    }
+    Mat::Prefetcher prefetcher(serialization, bin_names, prefetch_depth);
+    while (prefetcher.next(descriptors))
+      sampler.add(descriptors);
+
+    feature_vectors.clear();
+    featurebook = sampler.get();
+    sample_weights = sampler.getWeights();
+    return;
   }
+
+  sample_weights = cv::Mat();
+  feature_vectors.clear();
+  if (low_memory && readFeatureBook_(image_ext, suffix))
+    return;
+
+  Mat::Prefetcher prefetcher(serialization,
+                             serialization.binNames(image_ext, suffix),
+                             prefetch_depth);
+  feature_vectors.reserve(prefetcher.size());
+  cv::Mat descriptors;
+  while (prefetcher.next(descriptors))
+    feature_vectors.emplace_back(std::move(descriptors));
+  if (!feature_vectors.empty())
+    cv::vconcat(feature_vectors, featurebook);
+}
+
+bool CodeBook::readFeatureBook_(const std::filesystem::path &image_ext,
+                                const std::string &suffix) {
+  auto bin_names = serialization.binNames(image_ext, suffix);
+  std::vector<int> bin_rows(bin_names.size(), 0);
+  int total_rows = 0, cols = -1, type = -1;
+  for (size_t i{0}; i < bin_names.size(); i++) {
+    int rows, bin_cols, bin_type;
+    if (!serialization.header(bin_names.at(i), rows, bin_cols, bin_type))
+      return false;
+    if (rows == 0)
+      continue;
+    // Stacking needs every bin to have the same width and type
+    if (cols >= 0 && (bin_cols != cols || bin_type != type))
+      return false;
+    cols = bin_cols;
+    type = bin_type;
+    bin_rows.at(i) = rows;
+    total_rows += rows;
+  }
+  if (total_rows == 0)
+    return false;
+
+  featurebook.create(total_rows, cols, type);
+  int offset = 0;
+  for (size_t i{0}; i < bin_names.size(); i++) {
+    if (bin_rows.at(i) == 0)
+      continue;
+    cv::Mat block = featurebook.rowRange(offset, offset + bin_rows.at(i));
+    // A block that was not read in place would leave garbage rows behind
+    if (!serialization.deserialize(bin_names.at(i), block) ||
+        block.data != featurebook.ptr(offset)) {
+      featurebook.release();
+      return false;
+    }
+    offset += bin_rows.at(i);
+  }
+  return true;
 }
 
 void CodeBook::generate(const std::filesystem::path &image_ext,
@@ -48,19 +119,89 @@ void CodeBook::generate(const std::filesystem::path &image_ext,
     return;
   }
 
-  loadFeatureBook_(image_ext, suffix);
+  extraction = serialization.manifest(image_ext).getExtraction();
+  {
+    Memory::Stage stage("codebook.load_featurebook");
+    loadFeatureBook_(image_ext, suffix);
+
+    // Learn PCA on the full width descriptors and cluster in the reduced
+    // space
+    if (projection_dims > 0 && projection_dims < featurebook.cols) {
+      projection =
+          SIFT::Features::learnProjection(featurebook, projection_dims);
+      SIFT::Features reducer;
+      reducer.setProjection(projection);
+      featurebook = reducer.project(featurebook);
+    } else {
+      projection = cv::Mat();
+    }
+    stage.attach(memoryUsage());
+  }
+
   // Run kmeans to get codebook
-  cv::kmeans(featurebook, num_words, labels,
-             cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT,
-                              10, 1.0),
-             3, cv::KMEANS_PP_CENTERS, codebook);
+  Memory::Stage stage("codebook.kmeans");
+  kmeans_params.num_clusters = num_words;
+  kmeans_params.checkpoint = binary_path;
+  kmeans_params.checkpoint /= "codebook_checkpoint";
+  KMeans kmeans(kmeans_params);
+  kmeans.fit(featurebook, labels, codebook, sample_weights);
+
+  // Only the codebook is needed from here on
+  if (low_memory) {
+    featurebook.release();
+    labels.release();
+    sample_weights.release();
+  }
+  stage.attach(memoryUsage());
+}
+
+Memory::Usage CodeBook::memoryUsage() const {
+  return {{"feature_vectors", Memory::bytes(feature_vectors)},
+          {"featurebook", Memory::bytes(featurebook)},
+          {"labels", Memory::bytes(labels)},
+          {"codebook", Memory::bytes(codebook)}};
 }
 
 void CodeBook::load(const std::filesystem::path &name) {
   codebook = serialization.deserialize(name);
+
+  auto projection_name = name.stem();
+  projection_name += "_projection";
+  if (serialization.exists(projection_name))
+    projection = serialization.deserialize(projection_name);
+  else
+    projection = cv::Mat();
+
+  auto extraction_name = name.stem();
+  extraction_name += "_extraction";
+  if (!serialization.loadExtraction(extraction_name, extraction))
+    extraction = SIFT::Features::Settings();
 }
 
 void CodeBook::save(const std::filesystem::path &name) {
   serialization.serialize(codebook, name);
+
+  // A projection left over from an earlier save would be loaded with this
+  // codebook
+  auto projection_name = name.stem();
+  projection_name += "_projection";
+  if (!projection.empty())
+    serialization.serialize(projection, projection_name);
+  else
+    std::filesystem::remove(serialization.binPath(projection_name));
+
+  auto extraction_name = name.stem();
+  extraction_name += "_extraction";
+  serialization.saveExtraction(extraction, extraction_name);
+
+  // An index built for the previous codebook under this name is stale
+  auto index_path = binary_path;
+  index_path /= name.stem();
+  index_path += ".flann";
+  Quantizer::remove(index_path);
+
+  // The codebook is on disk, training does not need to be resumed anymore
+  if (!kmeans_params.checkpoint.empty())
+    KMeans(kmeans_params).removeCheckpoints();
 }
 
@@ -0,0 +1,136 @@
+#include "compression.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const size_t min_match = 4;
+const size_t max_offset = 65535;
+const int hash_bits = 16;
+
+uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint32_t hash(const uint32_t &value) {
+  return (value * 2654435761u) >> (32 - hash_bits);
+}
+
+// Lengths that do not fit the 4 bit token field continue in bytes of 255
+// terminated by a byte below 255
+void writeLength(std::string &out, size_t length) {
+  while (length >= 255) {
+    out.push_back(static_cast<char>(255));
+    length -= 255;
+  }
+  out.push_back(static_cast<char>(length));
+}
+
+bool readLength(const unsigned char *in, const size_t &in_size, size_t &pos,
+                size_t &length) {
+  if (length != 15)
+    return true;
+  unsigned char byte;
+  do {
+    if (pos >= in_size)
+      return false;
+    byte = in[pos++];
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+void writeSequence(std::string &out, const unsigned char *literals,
+                   const size_t &num_literals, const size_t &offset,
+                   const size_t &match_length) {
+  const size_t match_code = match_length ? match_length - min_match : 0;
+  const unsigned char token =
+      static_cast<unsigned char>((std::min<size_t>(num_literals, 15) << 4) |
+                                 std::min<size_t>(match_code, 15));
+  out.push_back(static_cast<char>(token));
+  if (num_literals >= 15)
+    writeLength(out, num_literals - 15);
+  out.append(reinterpret_cast<const char *>(literals), num_literals);
+  if (!match_length)
+    return;
+  out.push_back(static_cast<char>(offset & 0xFF));
+  out.push_back(static_cast<char>(offset >> 8));
+  if (match_code >= 15)
+    writeLength(out, match_code - 15);
+}
+
+} // namespace
+
+std::string Compression::compress(const unsigned char *data,
+                                  const size_t &size) {
+  std::string out;
+  out.reserve(size + size / 255 + 16);
+
+  // Last position each 4 byte prefix was seen at, -1 if never
+  std::vector<int64_t> table(size_t{1} << hash_bits, -1);
+  size_t anchor = 0, pos = 0;
+  while (pos + min_match <= size) {
+    const uint32_t value = read32(data + pos);
+    const uint32_t slot = hash(value);
+    const int64_t candidate = table[slot];
+    table[slot] = static_cast<int64_t>(pos);
+
+    if (candidate >= 0 && pos - candidate <= max_offset &&
+        read32(data + candidate) == value) {
+      size_t length = min_match;
+      while (pos + length < size &&
+             data[candidate + length] == data[pos + length])
+        length++;
+      writeSequence(out, data + anchor, pos - anchor, pos - candidate, length);
+      pos += length;
+      anchor = pos;
+    } else {
+      pos++;
+    }
+  }
+  writeSequence(out, data + anchor, size - anchor, 0, 0);
+  return out;
+}
+
+bool Compression::decompress(const std::string &block, unsigned char *data,
+                             const size_t &size) {
+  const auto *in = reinterpret_cast<const unsigned char *>(block.data());
+  const size_t in_size = block.size();
+  size_t in_pos = 0, out_pos = 0;
+
+  while (in_pos < in_size) {
+    const unsigned char token = in[in_pos++];
+    size_t num_literals = token >> 4;
+    if (!readLength(in, in_size, in_pos, num_literals) ||
+        in_pos + num_literals > in_size || out_pos + num_literals > size)
+      return false;
+    std::memcpy(data + out_pos, in + in_pos, num_literals);
+    in_pos += num_literals;
+    out_pos += num_literals;
+
+    // The last sequence ends after its literals
+    if (in_pos == in_size)
+      break;
+
+    if (in_pos + 2 > in_size)
+      return false;
+    const size_t offset = in[in_pos] | (in[in_pos + 1] << 8);
+    in_pos += 2;
+    size_t match_length = token & 0x0F;
+    if (!readLength(in, in_size, in_pos, match_length))
+      return false;
+    match_length += min_match;
+    if (offset == 0 || offset > out_pos || out_pos + match_length > size)
+      return false;
+
+    // Byte by byte as the copy may overlap its own output
+    for (size_t i{0}; i < match_length; i++, out_pos++)
+      data[out_pos] = data[out_pos - offset];
+  }
+  return out_pos == size;
+}
@@ -1,4 +1,7 @@
 #include "features.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
 
 SIFT::Features::Features(std::vector<cv::KeyPoint> &key_points,
                          cv::Mat &descriptors,
@@ -19,48 +22,208 @@ void SIFT::Features::extractDescriptors(
   cv::Mat des;
   auto kpts = key_points;
   feature_extractor->compute(img, kpts, des);
+  if (root_sift)
+    rootSIFT(des);
   descriptors = des;
 }
 
 void SIFT::Features::detectAndExtract(const cv::Mat &img) {
-  // auto detectorAndExtractor = cv::SIFT::create();
-  std::vector<cv::KeyPoint> kpts;
-  cv::Mat des;
-  detectorAndExtractor->detectAndCompute(img, cv::noArray(), kpts, des);
-  key_points = kpts;
-  descriptors = des;
+  // Results are written straight into the members, whose buffers are reused
+  // from the previous call
+  cv::Mat input = img;
+  double scale = 1.0;
+  if (target_width > 0 && img.cols > target_width) {
+    scale = static_cast<double>(img.cols) / target_width;
+    int height = cvRound(img.rows / scale);
+    cv::resize(img, resized, cv::Size(target_width, height), 0, 0,
+               cv::INTER_AREA);
+    input = resized;
+  }
+
+  key_points.clear();
+  if (max_features > 0 && grid_rows * grid_cols > 1) {
+    detector->detect(input, key_points);
+    retainBucketed_(key_points, input.size());
+    feature_extractor->compute(input, key_points, descriptors);
+  } else {
+    // SIFT ranks by response itself when created with nfeatures
+    detectorAndExtractor->detectAndCompute(input, cv::noArray(), key_points,
+                                           descriptors);
+  }
+  if (root_sift)
+    rootSIFT(descriptors);
+  rescale_(key_points, scale);
+}
+
+void SIFT::Features::detectAndExtract(const std::filesystem::path &name) {
+  const cv::Mat image = cv::imread(name, read_flags);
+  detectAndExtract(image);
+
+  // IMREAD_REDUCED_* decode at 1/2, 1/4 or 1/8 of the stored resolution
+  double factor = 1.0;
+  if (read_flags == cv::IMREAD_REDUCED_GRAYSCALE_2 ||
+      read_flags == cv::IMREAD_REDUCED_COLOR_2)
+    factor = 2.0;
+  else if (read_flags == cv::IMREAD_REDUCED_GRAYSCALE_4 ||
+           read_flags == cv::IMREAD_REDUCED_COLOR_4)
+    factor = 4.0;
+  else if (read_flags == cv::IMREAD_REDUCED_GRAYSCALE_8 ||
+           read_flags == cv::IMREAD_REDUCED_COLOR_8)
+    factor = 8.0;
+  rescale_(key_points, factor);
+}
+
+void SIFT::Features::rescale_(std::vector<cv::KeyPoint> &kpts,
+                              const double &factor) const {
+  if (factor == 1.0)
+    return;
+  for (auto &kpt : kpts) {
+    kpt.pt.x *= factor;
+    kpt.pt.y *= factor;
+    kpt.size *= factor;
+  }
+}
+
+void SIFT::Features::setMaxFeatures(const int &nfeatures) {
+  max_features = std::max(0, nfeatures);
+  detectorAndExtractor = cv::SIFT::create(max_features);
+}
+
+void SIFT::Features::setGrid(const int &rows, const int &cols) {
+  grid_rows = std::max(1, rows);
+  grid_cols = std::max(1, cols);
+}
+
+uint64_t SIFT::Features::Settings::hash() const {
+  const int settings[]{root_sift, max_features, grid_rows, grid_cols,
+                       read_flags, target_width};
+  return Hash::fnv1a(settings, sizeof(settings));
+}
+
+SIFT::Features::Settings SIFT::Features::getSettings() const {
+  return {root_sift, max_features, grid_rows, grid_cols, read_flags,
+          target_width};
+}
+
+void SIFT::Features::setSettings(const Settings &settings) {
+  setRootSIFT(settings.root_sift);
+  setMaxFeatures(settings.max_features);
+  setGrid(settings.grid_rows, settings.grid_cols);
+  setReadMode(settings.read_flags);
+  setTargetWidth(settings.target_width);
+}
+
+void SIFT::Features::retainStrongest_(std::vector<cv::KeyPoint> &kpts,
+                                      const int &n) {
+  if (static_cast<int>(kpts.size()) <= n)
+    return;
+  std::nth_element(kpts.begin(), kpts.begin() + n, kpts.end(),
+                   [](const cv::KeyPoint &a, const cv::KeyPoint &b) {
+                     return a.response > b.response;
+                   });
+  kpts.resize(n);
+}
+
+void SIFT::Features::retainBucketed_(std::vector<cv::KeyPoint> &kpts,
+                                     const cv::Size &size) {
+  if (static_cast<int>(kpts.size()) <= max_features)
+    return;
+
+  const int num_cells = grid_rows * grid_cols;
+  const int cell_budget = (max_features + num_cells - 1) / num_cells;
+  const float cell_width = static_cast<float>(size.width) / grid_cols;
+  const float cell_height = static_cast<float>(size.height) / grid_rows;
+
+  // Cells keep their capacity between calls
+  cells.resize(num_cells);
+  for (auto &cell : cells)
+    cell.clear();
+  for (const auto &kpt : kpts) {
+    int col = std::min(grid_cols - 1, static_cast<int>(kpt.pt.x / cell_width));
+    int row =
+        std::min(grid_rows - 1, static_cast<int>(kpt.pt.y / cell_height));
+    cells.at(row * grid_cols + col).push_back(kpt);
+  }
+
+  kpts.clear();
+  for (auto &cell : cells) {
+    retainStrongest_(cell, cell_budget);
+    kpts.insert(kpts.end(), cell.begin(), cell.end());
+  }
+  // Rounding up the per cell budget may overshoot by a few
+  retainStrongest_(kpts, max_features);
+}
+
+void SIFT::Features::rootSIFT(cv::Mat &des) {
+  if (des.empty())
+    return;
+  for (int i{0}; i < des.rows; i++) {
+    cv::Mat row = des.row(i);
+    cv::normalize(row, row, 1.0, 0.0, cv::NORM_L1);
+  }
+  cv::sqrt(des, des);
+}
+
+void SIFT::Features::setProjection(const cv::Mat &projection) {
+  if (projection.empty()) {
+    pca = cv::PCA();
+    return;
+  }
+  pca.mean = projection.row(0).clone();
+  pca.eigenvectors = projection.rowRange(1, projection.rows).clone();
+}
+
+cv::Mat SIFT::Features::project(const cv::Mat &des) const {
+  if (pca.eigenvectors.empty() || des.empty())
+    return des;
+  return pca.project(des);
+}
+
+void SIFT::Features::project(const cv::Mat &des, cv::Mat &projected) const {
+  if (pca.eigenvectors.empty() || des.empty()) {
+    projected = des;
+    return;
+  }
+  pca.project(des, projected);
+}
+
+cv::Mat SIFT::Features::learnProjection(const cv::Mat &descriptors,
+                                        const int &dims) {
+  cv::PCA pca(descriptors, cv::noArray(), cv::PCA::DATA_AS_ROW, dims);
+  cv::Mat projection;
+  cv::vconcat(pca.mean, pca.eigenvectors, projection);
+  return projection;
 }
 
 void SIFT::Features::matchFeatures(const cv::Mat &descriptor1,
                                    const cv::Mat &descriptor2) {
   // auto matcher =
   //     cv::DescriptorMatcher::create(cv::DescriptorMatcher::FLANNBASED);
-  std::vector<std::vector<cv::DMatch>> knn_matches;
-  std::vector<cv::DMatch> matches;
   matcher->knnMatch(descriptor1, descriptor2, knn_matches, 2);
 
   const float ratio_thresh = 0.75f;
+  good_matches.clear();
   for (size_t i = 0; i < knn_matches.size(); i++) {
-    if (knn_matches[i][0].distance <
-        ratio_thresh * knn_matches[i][1].distance) {
-      matches.push_back(knn_matches[i][0]);
+    if (knn_matches[i].size() > 1 &&
+        knn_matches[i][0].distance <
+            ratio_thresh * knn_matches[i][1].distance) {
+      good_matches.push_back(knn_matches[i][0]);
     }
   }
-  good_matches = matches;
 }
 
 void SIFT::Features::findCorrespondences(const cv::Mat &img1,
                                          const cv::Mat &img2, bool show) {
   detectAndExtract(img1);
-  auto kpts1 = getKeyPoints();
-  auto descriptor1 = getDescriptors();
+  auto kpts1 = takeKeyPoints();
+  auto descriptor1 = takeDescriptors();
 
   detectAndExtract(img2);
-  auto kpts2 = getKeyPoints();
-  auto descriptor2 = getDescriptors();
+  const auto &kpts2 = getKeyPoints();
+  const auto &descriptor2 = getDescriptors();
 
   matchFeatures(descriptor1, descriptor2);
-  auto matches = getMatches();
+  const auto &matches = getMatches();
 
   if (show) {
     cv::Mat img_matches;
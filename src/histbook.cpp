@@ -1,7 +1,74 @@
 #include "histbook.hpp"
+#include "hash.hpp"
+#include "prefetcher.hpp"
 #include <algorithm>
+#include <atomic>
+#include <cereal/types/map.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+#include <charconv>
 #include <fstream>
+#include <iomanip>
 #include <numeric>
+#include <set>
+#include <sstream>
+#include <utility>
+
+namespace {
+
+using Distances = std::vector<std::pair<double, const std::string *>>;
+
+// Per thread buffers reused by every histogram computation and query on
+// that thread, so the steady state per frame does not reallocate
+struct Scratch {
+  SIFT::Features sift;
+  // extractor_config of the HistBook sift was last set up for
+  uint64_t sift_config{0};
+  cv::Mat projected;
+  std::vector<cv::DMatch> matches;
+  std::vector<int> histogram;
+  std::vector<double> tfidf;
+  Distances distances;
+  // Top k of each shard of the last query
+  std::vector<Distances> shard_distances;
+  // Normalized query batch and its scores against the dense histbook
+  cv::Mat queries, scores;
+};
+
+Scratch &scratch() {
+  thread_local Scratch buffers;
+  return buffers;
+}
+
+// Keeps the k closest, sorted. Names are unique, so ties are broken the same
+// way however the candidates were gathered.
+void keepClosest(Distances &distances, const size_t &k) {
+  const size_t num_matches = std::min(distances.size(), k);
+  std::partial_sort(distances.begin(), distances.begin() + num_matches,
+                    distances.end(), [](const auto &a, const auto &b) {
+                      return a.first < b.first ||
+                             (a.first == b.first && *a.second < *b.second);
+                    });
+  distances.resize(num_matches);
+}
+
+// Parses a whole header value, trailing spaces aside. Returns false instead
+// of throwing on malformed files.
+template <typename T>
+bool parseValue(const std::string &str, T &value, const int &base = 10) {
+  const size_t last = str.find_last_not_of(' ');
+  if (last == std::string::npos)
+    return false;
+  const char *end = str.data() + last + 1;
+  auto [ptr, ec] = std::from_chars(str.data(), end, value, base);
+  return ec == std::errc() && ptr == end;
+}
+
+// Unique across all HistBooks, so a thread never mistakes another
+// instance's settings for its own
+std::atomic<uint64_t> next_extractor_config{1};
+
+} // namespace
 
 HistBook::HistBook(const cv::Mat &codebook,
                    const std::filesystem::path &data_path,
@@ -13,9 +80,12 @@ HistBook::HistBook(const cv::Mat &codebook,
     path /= "bin";
     this->binary_path = path;
   }
+  newExtractorConfig_();
   histogram_length = codebook.rows;
   std::vector<int> occurances(histogram_length, 0);
   word_occurances = occurances;
+  if (histogram_length)
+    quantizer.build(codebook);
 
   isvalidPath_();
 
@@ -38,19 +108,88 @@ int HistBook::isvalidPath_() {
   return valid_path;
 }
 
-std::vector<int> HistBook::computeHist_(const cv::Mat &des) {
+void HistBook::newExtractorConfig_() {
+  extractor_config = next_extractor_config.fetch_add(1);
+}
+
+void HistBook::setExtraction(const SIFT::Features::Settings &extraction) {
+  this->extraction = extraction;
+  newExtractorConfig_();
+}
+
+bool HistBook::sameExtraction_(const std::filesystem::path &image_ext) const {
+  if (deserialize.manifest(image_ext).getExtraction().hash() ==
+      extraction.hash())
+    return true;
+  std::cout << "ERROR: The bins of " << image_ext
+            << " images were extracted with other settings than the codebook"
+            << std::endl;
+  return false;
+}
+
+SIFT::Features &HistBook::extractor_() const {
+  Scratch &buffers = scratch();
+  if (buffers.sift_config != extractor_config) {
+    // A fresh instance, so no SIFT detector is shared between threads
+    buffers.sift = SIFT::Features();
+    buffers.sift.setSettings(extraction);
+    buffers.sift_config = extractor_config;
+  }
+  return buffers.sift;
+}
+
+bool HistBook::loadCodeBook(const std::filesystem::path &name) {
+  auto extraction_name = name.stem();
+  extraction_name += "_extraction";
+  SIFT::Features::Settings settings;
+  if (!deserialize.loadExtraction(extraction_name, settings)) {
+    std::cout << "ERROR: Codebook " << name
+              << " has no extraction settings, run preprocess again"
+              << std::endl;
+    return false;
+  }
+  setExtraction(settings);
+
+  codebook = deserialize.deserialize(name);
+  histogram_length = codebook.rows;
+  word_occurances.assign(histogram_length, 0);
+
+  auto projection_name = name.stem();
+  projection_name += "_projection";
+  if (deserialize.exists(projection_name))
+    sift.setProjection(deserialize.deserialize(projection_name));
+  else
+    sift.setProjection(cv::Mat());
+
+  auto index_path = binary_path;
+  index_path /= name.stem();
+  index_path += ".flann";
+  if (!quantizer.load(codebook, index_path))
+    quantizer.build(codebook);
+  return true;
+}
+
+void HistBook::saveIndex(const std::filesystem::path &name) const {
+  auto index_path = binary_path;
+  index_path /= name.stem();
+  index_path += ".flann";
+  quantizer.save(index_path);
+}
+
+void HistBook::computeHist_(const cv::Mat &des,
+                            std::vector<int> &histogram) const {
   if (!codebook.rows)
     std::cout << "ERROR: CodeBook Loading Error" << std::endl;
 
-  sift.matchFeatures(des, codebook);
-  matches = sift.getMatches();
+  Scratch &buffers = scratch();
+  sift.project(des, buffers.projected);
+  quantizer.match(buffers.projected, buffers.matches);
 
-  std::vector<int> histogram(histogram_length, 0);
-  for (const auto &match : matches) {
+  histogram.assign(histogram_length, 0);
+  for (const auto &match : buffers.matches) {
     int idx = match.trainIdx;
     histogram.at(idx) += 1;
   }
-  return histogram;
 }
 
 void HistBook::computeHistAll_(const std::filesystem::path &ext,
@@ -59,94 +198,282 @@ void HistBook::computeHistAll_(const std::filesystem::path &ext,
     std::cout << "Enter valid extension stating with .";
     return;
   }
+  computeHists_(deserialize.binNames(ext, suffix));
+}
 
-  std::vector<cv::String> imnames;
-  auto path = data_path;
-  (path /= "*") += ext;
-  cv::glob(path, imnames, false);
+void HistBook::computeHists_(
+    const std::vector<std::filesystem::path> &bin_names) {
+  // Descriptors of the next images are read while the current one is
+  // quantized
+  Mat::Prefetcher prefetcher(deserialize, bin_names, prefetch_depth);
+  cv::Mat descriptor;
+  for (size_t i{0}; prefetcher.next(descriptor); i++)
+    setHist_(bin_names.at(i).string(), descriptor);
+  histbook_size = histbook_raw.size();
+}
+
+void HistBook::setHist_(const std::string &name, const cv::Mat &des) {
+  std::vector<int> &histogram = histbook_raw[name];
+  // Replaces the histogram of an image computed before
+  countWords_(histogram, -1);
+  computeHist_(des, histogram);
+  countWords_(histogram, 1);
+}
 
-  for (int i{0}; i < imnames.size(); i++) {
-    std::filesystem::path filename = imnames.at(i);
-    std::string name = (filename.stem()) += suffix;
-    cv::Mat descriptor = deserialize.deserialize(name);
+void HistBook::countWords_(const std::vector<int> &histogram,
+                           const int &sign) {
+  // Word occurances in all images
+  for (size_t k{0}; k < histogram.size(); k++) {
+    if (histogram.at(k) > 0)
+      word_occurances.at(k) += sign;
+  }
+}
 
-    std::vector<int> histogram = computeHist_(descriptor);
-    histbook_raw[name] = histogram;
+void HistBook::weightAll_() {
+  auto next = std::make_shared<Snapshot>();
+  next->word_occurances = word_occurances;
+  next->histbook_size = histbook_size;
+  for (auto it = histbook_raw.begin(); it != histbook_raw.end();) {
+    TF_IDF_(it->second, *next, next->histbook[it->first]);
+    // Raw counts are dropped as soon as they are weighted so both books are
+    // never fully resident at once
+    if (low_memory)
+      it = histbook_raw.erase(it);
+    else
+      ++it;
+  }
+  publish_(std::move(next));
+}
+
+void HistBook::publish_(std::shared_ptr<Snapshot> next) {
+  next->shards.assign(num_shards, {});
+  for (const auto &[name, hist] : next->histbook) {
+    const double norm =
+        sqrt(std::inner_product(hist.begin(), hist.end(), hist.begin(), 0.0));
+    next->shards.at(shardOf_(name, num_shards)).push_back({&name, &hist, norm});
+  }
 
-    // Word occurances in all images
-    for (size_t k{0}; k < histogram_length; k++) {
-      if (histogram.at(k) > 0)
-        word_occurances.at(k) += 1;
+  if (dense && !next->histbook.empty()) {
+    // One column per word, the width queries are weighted to
+    next->dense.create(next->histbook.size(), next->word_occurances.size(),
+                       CV_32F);
+    next->dense_names.clear();
+    int row = 0;
+    for (auto &[name, hist] : next->histbook) {
+      CV_Assert(hist.size() == next->word_occurances.size());
+      cv::Mat dense_row = next->dense.row(row);
+      cv::Mat(1, hist.size(), CV_64F, hist.data()).convertTo(dense_row, CV_32F);
+      const double norm = cv::norm(dense_row);
+      if (norm > 0)
+        dense_row /= norm;
+      next->dense_names.emplace_back(&name);
+      row++;
     }
   }
-  histbook_size = histbook_raw.size();
+  std::atomic_store(&snapshot, std::move(next));
+}
+
+size_t HistBook::shardOf_(const std::string &name, const size_t &num_shards) {
+  // Not std::hash, so an image lands in the same shard on every platform
+  return Hash::fnv1a(name) % num_shards;
+}
+
+void HistBook::setShards(const int &num_shards) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  this->num_shards = std::max(1, num_shards);
+  republish_();
+}
+
+void HistBook::setDense(const bool &dense) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  this->dense = dense;
+  republish_();
+}
+
+void HistBook::republish_() {
+  const std::shared_ptr<const Snapshot> current = current_();
+  auto next = std::make_shared<Snapshot>();
+  next->histbook = current->histbook;
+  next->word_occurances = current->word_occurances;
+  next->histbook_size = current->histbook_size;
+  publish_(std::move(next));
 }
 
-std::vector<double> HistBook::TF_IDF_(const std::vector<int> &hist) {
+void HistBook::TF_IDF_(const std::vector<int> &hist, const Snapshot &weights,
+                       std::vector<double> &histogram) {
+  const auto &word_occurances = weights.word_occurances;
   double word_count = std::accumulate(hist.begin(), hist.end(), 0);
-  std::vector<double> histogram(histogram_length, 0);
-  for (size_t k{0}; k < histogram_length; k++) {
+  histogram.assign(word_occurances.size(), 0);
+  for (size_t k{0}; k < word_occurances.size(); k++) {
     // TF-IDF formula
     histogram.at(k) = std::max(
         0.0,
         ((double)hist.at(k) / word_count) *
-            (log((double)histbook_size /
+            (log((double)weights.histbook_size /
                  word_occurances.at(k)))); // TODO:: Looks problematic as
                                            // word_occurances.at(k) can be zero
   }
-  return histogram;
 }
 
-std::vector<std::string>
-HistBook::KNMatcher_(const std::vector<double> &query_hist, const int k) {
-  if (!histbook.size())
+std::shared_ptr<const HistBook::Snapshot>
+HistBook::rank_(const std::vector<int> &query_raw, const int k) const {
+  // Weighted and ranked against one version, even if a writer publishes the
+  // next one meanwhile
+  const std::shared_ptr<const Snapshot> current = current_();
+  if (!current->histbook.size())
     std::cout << "ERROR: Unable to load HistBook" << std::endl;
 
-  std::vector<double> cossim;
-  std::vector<std::string> names;
-
+  Scratch &buffers = scratch();
+  const auto &query_hist = buffers.tfidf;
+  TF_IDF_(query_raw, *current, buffers.tfidf);
   double norm_y = sqrt(std::inner_product(query_hist.begin(), query_hist.end(),
                                           query_hist.begin(), 0.0));
 
-  for (const auto &[name, hist] : histbook) {
-    double norm_x =
-        sqrt(std::inner_product(hist.begin(), hist.end(), hist.begin(), 0.0));
+  const size_t num_matches = std::max(0, k);
+  const auto &shards = current->shards;
+  auto &shard_distances = buffers.shard_distances;
+  shard_distances.resize(std::max(shard_distances.size(), shards.size()));
+  auto scoreShard = [&](const size_t &s) {
+    auto &distances = shard_distances.at(s);
+    distances.clear();
+    for (const auto &entry : shards.at(s)) {
+      const auto &hist = *entry.hist;
+      double numerator =
+          std::inner_product(hist.begin(), hist.end(), query_hist.begin(), 0.0);
+      double denominator = entry.norm * norm_y;
+
+      // Cosine Similarity -> best match should be close to zero; worst
+      // should be close to 1. An empty histogram matches nothing, and a NaN
+      // would break the ordering keepClosest sorts by.
+      double cosine_similarity =
+          denominator == 0 ? 1.0 : 1.0 - (numerator / denominator);
+      distances.emplace_back(cosine_similarity, entry.name);
+    }
+    keepClosest(distances, num_matches);
+  };
+  if (shards.size() > 1) {
+    cv::parallel_for_(cv::Range(0, shards.size()), [&](const cv::Range &range) {
+      for (int s = range.start; s < range.end; s++)
+        scoreShard(s);
+    });
+  } else if (!shards.empty()) {
+    scoreShard(0);
+  }
+
+  // The global top k is among the top k of the shards
+  auto &distances = buffers.distances;
+  distances.clear();
+  for (size_t s{0}; s < shards.size(); s++)
+    distances.insert(distances.end(), shard_distances.at(s).begin(),
+                     shard_distances.at(s).end());
+  keepClosest(distances, num_matches);
+  return current;
+}
+
+std::vector<std::string>
+HistBook::KNMatcher_(const std::vector<int> &query_raw, const int k) const {
+  // Keeps the names the distances point to alive
+  const auto ranked = rank_(query_raw, k);
+  const auto &distances = scratch().distances;
+  std::vector<std::string> kmatches;
+  kmatches.reserve(distances.size());
+  for (const auto &match : distances)
+    kmatches.emplace_back(*match.second);
+  return kmatches;
+}
 
-    double numerator =
-        std::inner_product(hist.begin(), hist.end(), query_hist.begin(), 0.0);
-    double denominator = norm_x * norm_y;
+std::vector<std::pair<std::string, double>>
+HistBook::KNScores(const std::vector<int> &histogram, const int &k) const {
+  const auto ranked = rank_(histogram, k);
+  const auto &distances = scratch().distances;
+  std::vector<std::pair<std::string, double>> scores;
+  scores.reserve(distances.size());
+  for (const auto &[distance, name] : distances)
+    scores.emplace_back(*name, distance);
+  return scores;
+}
 
-    // Cosine Similarity -> best match should be close to zero; worst should be
-    // close to 1
-    double cosine_similarity = 1.0 - (numerator / denominator);
-    cossim.emplace_back(cosine_similarity);
-    names.emplace_back(name);
+std::vector<std::vector<std::pair<std::string, double>>>
+HistBook::KNScoresBatch(const std::vector<std::vector<int>> &histograms,
+                        const int &k) const {
+  std::vector<std::vector<std::pair<std::string, double>>> results;
+  results.reserve(histograms.size());
+  const std::shared_ptr<const Snapshot> current = current_();
+  if (current->dense.empty()) {
+    for (const auto &histogram : histograms)
+      results.emplace_back(KNScores(histogram, k));
+    return results;
   }
 
-  std::vector<std::string> kmatches;
-  for (size_t i{0}; i < k; i++) {
-    auto closest_match = std::min_element(cossim.begin(), cossim.end());
-    auto idx = std::distance(cossim.begin(), closest_match);
-    kmatches.emplace_back(names.at(idx));
-    cossim.erase(cossim.begin() + idx);
-    names.erase(names.begin() + idx);
+  // One normalized tf-idf query per row, so each score is a cosine
+  CV_Assert(current->dense.cols ==
+            static_cast<int>(current->word_occurances.size()));
+  Scratch &buffers = scratch();
+  buffers.queries.create(histograms.size(), current->word_occurances.size(),
+                         CV_32F);
+  for (size_t i{0}; i < histograms.size(); i++) {
+    TF_IDF_(histograms.at(i), *current, buffers.tfidf);
+    cv::Mat row = buffers.queries.row(i);
+    cv::Mat(1, buffers.tfidf.size(), CV_64F, buffers.tfidf.data())
+        .convertTo(row, CV_32F);
+    const double norm = cv::norm(row);
+    if (norm > 0)
+      row /= norm;
   }
-  return kmatches;
+  // queries x images
+  cv::gemm(buffers.queries, current->dense, 1.0, cv::noArray(), 0.0,
+           buffers.scores, cv::GEMM_2_T);
+
+  const size_t num_matches = std::max(0, k);
+  auto &distances = buffers.distances;
+  for (int i{0}; i < buffers.scores.rows; i++) {
+    const float *score = buffers.scores.ptr<float>(i);
+    distances.clear();
+    for (int j{0}; j < buffers.scores.cols; j++)
+      distances.emplace_back(1.0 - score[j], current->dense_names.at(j));
+    keepClosest(distances, num_matches);
+
+    auto &scores = results.emplace_back();
+    scores.reserve(distances.size());
+    for (const auto &[distance, name] : distances)
+      scores.emplace_back(*name, distance);
+  }
+  return results;
 }
 
-std::vector<int> HistBook::computeHist(const cv::Mat &image) {
-  sift.detectAndExtract(image);
-  cv::Mat des = sift.getDescriptors();
-  std::vector<int> histogram = computeHist_(des);
+std::vector<int> HistBook::computeHist(const cv::Mat &image) const {
+  std::vector<int> histogram;
+  computeHist(image, histogram);
   return histogram;
 }
 
-std::vector<int> HistBook::computeHist(const std::filesystem::path &name) {
-  const cv::Mat image = cv::imread(name, cv::IMREAD_COLOR);
-  std::vector<int> histogram = computeHist(image);
+std::vector<int>
+HistBook::computeHist(const std::filesystem::path &name) const {
+  std::vector<int> histogram;
+  computeHist(name, histogram);
   return histogram;
 }
 
+cv::Mat HistBook::extractDescriptors(const cv::Mat &image) const {
+  SIFT::Features &extractor = extractor_();
+  extractor.detectAndExtract(image);
+  return extractor.getDescriptors().clone();
+}
+
+void HistBook::computeHist(const cv::Mat &image,
+                           std::vector<int> &histogram) const {
+  SIFT::Features &extractor = extractor_();
+  extractor.detectAndExtract(image);
+  computeHist_(extractor.getDescriptors(), histogram);
+}
+
+void HistBook::computeHist(const std::filesystem::path &name,
+                           std::vector<int> &histogram) const {
+  SIFT::Features &extractor = extractor_();
+  extractor.detectAndExtract(name);
+  computeHist_(extractor.getDescriptors(), histogram);
+}
+
 void HistBook::displayHist(const std::vector<int> &hist) {
   int max = *max_element(hist.begin(), hist.end());
   auto row = max;
@@ -184,15 +511,150 @@ void HistBook::displayHist(const std::filesystem::path &name) {
 
 void HistBook::generate(const std::filesystem::path &image_ext,
                         const std::string &suffix) {
-  computeHistAll_(image_ext, suffix);
-  for (auto &[name, hist] : histbook_raw) {
-    std::vector<double> histogram = TF_IDF_(hist);
-    histbook[name] = histogram;
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  if (!sameExtraction_(image_ext))
+    return;
+  {
+    Memory::Stage stage("histbook.quantize");
+    computeHistAll_(image_ext, suffix);
+    stage.attach(memoryUsage());
   }
+  Memory::Stage stage("histbook.tf_idf");
+  weightAll_();
+  stage.attach(memoryUsage());
 }
 
-void HistBook::save(const std::filesystem::path &name,
-                    const std::string &suffix) {
+void HistBook::update(const std::filesystem::path &image_ext,
+                      const std::vector<std::filesystem::path> &changed,
+                      const std::string &suffix) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  if (!sameExtraction_(image_ext))
+    return;
+  const auto bin_names = deserialize.binNames(image_ext, suffix);
+  std::set<std::string> current, recompute;
+  for (const auto &name : bin_names)
+    current.insert(name.string());
+  for (const auto &name : changed)
+    recompute.insert(name.string());
+
+  {
+    Memory::Stage stage("histbook.quantize");
+    // Images no longer in the data folder
+    for (auto it = histbook_raw.begin(); it != histbook_raw.end();) {
+      if (current.count(it->first)) {
+        ++it;
+        continue;
+      }
+      countWords_(it->second, -1);
+      it = histbook_raw.erase(it);
+    }
+
+    std::vector<std::filesystem::path> to_compute;
+    for (const auto &name : bin_names) {
+      if (recompute.count(name.string()) || !histbook_raw.count(name.string()))
+        to_compute.emplace_back(name);
+    }
+    computeHists_(to_compute);
+    stage.attach(memoryUsage());
+  }
+
+  // Document frequencies changed, so every histogram is weighted again
+  Memory::Stage stage("histbook.tf_idf");
+  weightAll_();
+  stage.attach(memoryUsage());
+}
+
+bool HistBook::insert(const std::map<std::string, cv::Mat> &descriptors) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  if (histbook_raw.size() != current_()->histbook.size()) {
+    std::cout << "ERROR: Inserting needs the raw histograms of the histbook, "
+                 "see loadRaw()"
+              << std::endl;
+    return false;
+  }
+  // Checked up front, so a bad batch leaves the histbook untouched
+  const int cols =
+      sift.getProjectionCols() ? sift.getProjectionCols() : codebook.cols;
+  for (const auto &[name, des] : descriptors) {
+    if (!des.empty() && (des.type() != CV_32F || des.cols != cols)) {
+      std::cout << "ERROR: Descriptors of " << name << " are not CV_32F with "
+                << cols << " columns" << std::endl;
+      return false;
+    }
+  }
+  for (const auto &[name, des] : descriptors)
+    setHist_(name, des);
+  histbook_size = histbook_raw.size();
+  weightAll_();
+  return true;
+}
+
+void HistBook::saveRaw(const std::filesystem::path &name) const {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  auto path = binary_path;
+  (path /= name.stem()) += "_raw.bin";
+  std::ofstream file(path.c_str(), std::ios::binary);
+  cereal::BinaryOutputArchive ar(file);
+  ar(KMeans::fingerprint(codebook), word_occurances, histbook_raw);
+}
+
+bool HistBook::loadRaw(const std::filesystem::path &name) {
+  auto path = binary_path;
+  (path /= name.stem()) += "_raw.bin";
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if (!file)
+    return false;
+
+  uint64_t fingerprint;
+  std::vector<int> occurances;
+  std::map<std::string, std::vector<int>> raw;
+  try {
+    cereal::BinaryInputArchive ar(file);
+    ar(fingerprint, occurances, raw);
+  } catch (const std::exception &e) {
+    std::cout << "ERROR: Could not read " << path << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+  if (fingerprint != KMeans::fingerprint(codebook) ||
+      occurances.size() != static_cast<size_t>(histogram_length)) {
+    std::cout << "ERROR: Raw HistBook " << path
+              << " was generated with a different codebook" << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  word_occurances = std::move(occurances);
+  histbook_raw = std::move(raw);
+  histbook_size = histbook_raw.size();
+  return true;
+}
+
+std::map<std::string, std::vector<double>> HistBook::takeHistBook() {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  auto taken = std::atomic_exchange(&snapshot, std::make_shared<Snapshot>());
+  // Queries still running on it keep their version, so it is copied then
+  if (taken.use_count() > 1)
+    return taken->histbook;
+  return std::move(taken->histbook);
+}
+
+std::map<std::string, std::vector<int>> HistBook::takeHistBookRaw() {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  auto taken = std::move(histbook_raw);
+  histbook_raw.clear();
+  return taken;
+}
+
+Memory::Usage HistBook::memoryUsage() const {
+  return {{"histbook_raw", Memory::bytes(histbook_raw)},
+          {"histbook", Memory::bytes(current_()->histbook)},
+          {"dense", Memory::bytes(current_()->dense)},
+          {"word_occurances", Memory::bytes(word_occurances)},
+          {"codebook", Memory::bytes(codebook)}};
+}
+
+std::filesystem::path
+HistBook::histBookPath_(const std::filesystem::path &name) const {
   auto filename = name;
   auto path = data_path;
   if (!filename.has_extension())
@@ -200,53 +662,111 @@ void HistBook::save(const std::filesystem::path &name,
   else if (filename.extension() != ".txt")
     filename = (filename.stem()) += ".txt";
   path /= filename;
+  return path;
+}
 
+std::filesystem::path HistBook::shardPath_(const std::filesystem::path &name,
+                                           const int &shard) const {
+  auto shard_name = name.stem();
+  shard_name += "_shard" + std::to_string(shard);
+  return histBookPath_(shard_name);
+}
+
+void HistBook::writeHistBook_(const std::filesystem::path &path,
+                              const Snapshot &snapshot,
+                              const int &shard) const {
   std::ofstream out_file{path.c_str()};
+  // Histograms are only meaningful for the codebook they were computed with
+  out_file << "codebook " << std::hex << std::setw(16) << std::setfill('0')
+           << KMeans::fingerprint(codebook) << std::dec << "\n";
+  if (shard >= 0) {
+    out_file << "images " << snapshot.histbook_size << "\n";
+    out_file << "shard " << shard << " " << snapshot.shards.size() << "\n";
+  }
+
   out_file << "word_occurances";
-  for (const auto &bin : word_occurances) {
+  for (const auto &bin : snapshot.word_occurances) {
     out_file << " " << bin;
   }
   out_file << "\n";
 
-  for (const auto &[name, hist] : histbook) {
+  auto writeHist = [&out_file](const std::string &name,
+                               const std::vector<double> &hist) {
     out_file << name;
     for (const auto &val : hist)
       out_file << " " << val;
     out_file << "\n";
+  };
+  if (shard < 0) {
+    for (const auto &[name, hist] : snapshot.histbook)
+      writeHist(name, hist);
+  } else {
+    for (const auto &entry : snapshot.shards.at(shard))
+      writeHist(*entry.name, *entry.hist);
   }
   out_file.close();
 }
 
-std::map<std::string, std::vector<double>>
-HistBook::load(const std::filesystem::path &name, const std::string &suffix) {
-  std::map<std::string, std::vector<double>> loaded_histbook;
-
-  auto filename = name;
-  if (!filename.has_extension())
-    filename += ".txt";
-  else if (filename.extension() != ".txt")
-    filename = (filename.stem()) += ".txt";
-
-  auto path = data_path;
-  path /= filename;
-
+bool HistBook::readHistBook_(const std::filesystem::path &path,
+                             Snapshot &into) const {
   std::ifstream in_file{path.c_str()};
+  if (!in_file) {
+    std::cout << "ERROR: Could not read " << path << std::endl;
+    return false;
+  }
   std::string line;
   std::string delimiter = " ";
 
-  // Get word_occurances stored in first line
+  // Codebook fingerprint in first line. Histbooks saved before fingerprints
+  // existed start with word_occurances directly.
   std::getline(in_file, line);
   std::string identifier = line.substr(0, line.find(delimiter));
   line.erase(0, identifier.length() + delimiter.length());
+  if (identifier == "codebook") {
+    uint64_t saved;
+    if (!parseValue(line, saved, 16)) {
+      std::cout << "ERROR: HistBook " << path
+                << " has a malformed codebook fingerprint" << std::endl;
+      return false;
+    }
+    if (codebook.rows && saved != KMeans::fingerprint(codebook)) {
+      std::cout << "ERROR: HistBook " << path
+                << " was generated with a different codebook" << std::endl;
+      return false;
+    }
+    std::getline(in_file, line);
+    identifier = line.substr(0, line.find(delimiter));
+    line.erase(0, identifier.length() + delimiter.length());
+  } else {
+    std::cout << "Warning: HistBook " << path
+              << " has no codebook fingerprint" << std::endl;
+  }
 
-  size_t pos = 0;
-  int count = 0;
-  std::string val;
-  while ((pos = line.find(delimiter)) != std::string::npos) {
-    val = line.substr(0, pos);
-    word_occurances.at(count) = std::stoi(val);
-    line.erase(0, pos + delimiter.length());
-    count++;
+  // Shard files also hold the size of the whole histbook
+  int images = -1;
+  while (identifier == "images" || identifier == "shard") {
+    if (identifier == "images" && (!parseValue(line, images) || images < 0)) {
+      std::cout << "ERROR: HistBook " << path
+                << " has a malformed image count" << std::endl;
+      return false;
+    }
+    std::getline(in_file, line);
+    identifier = line.substr(0, line.find(delimiter));
+    line.erase(0, identifier.length() + delimiter.length());
+  }
+
+  // Get word_occurances. Every value is preceded by a delimiter, including
+  // the last one on the line.
+  std::istringstream values(line);
+  into.word_occurances.clear();
+  for (int val; values >> val;)
+    into.word_occurances.emplace_back(val);
+  if (codebook.rows &&
+      into.word_occurances.size() != static_cast<size_t>(codebook.rows)) {
+    std::cout << "ERROR: HistBook " << path << " has "
+              << into.word_occurances.size() << " words, the codebook "
+              << codebook.rows << std::endl;
+    return false;
   }
 
   while (std::getline(in_file, line)) {
@@ -254,41 +774,98 @@ HistBook::load(const std::filesystem::path &name, const std::string &suffix) {
     line.erase(0, name.length() + delimiter.length());
 
     std::vector<double> hist;
-    while ((pos = line.find(delimiter)) != std::string::npos) {
-      val = line.substr(0, pos);
-      hist.emplace_back(std::stod(val));
-      line.erase(0, pos + delimiter.length());
+    hist.reserve(into.word_occurances.size());
+    values.clear();
+    values.str(line);
+    for (double val; values >> val;)
+      hist.emplace_back(val);
+    if (hist.size() != into.word_occurances.size()) {
+      std::cout << "ERROR: HistBook " << path << " has a truncated row for "
+                << name << std::endl;
+      return false;
     }
 
-    loaded_histbook[name] = hist;
+    into.histbook[name] = hist;
   }
   in_file.close();
 
-  // Setters
-  histbook = loaded_histbook;
-  histbook_size = histbook.size();
+  into.histbook_size = images >= 0 ? images : into.histbook.size();
+  return true;
+}
+
+void HistBook::save(const std::filesystem::path &name,
+                    const std::string &suffix) {
+  writeHistBook_(histBookPath_(name), *current_());
+}
 
+std::map<std::string, std::vector<double>>
+HistBook::load(const std::filesystem::path &name, const std::string &suffix) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  auto next = std::make_shared<Snapshot>();
+  if (!readHistBook_(histBookPath_(name), *next))
+    return {};
+
+  // Setters
+  word_occurances = next->word_occurances;
+  histbook_size = next->histbook_size;
+  auto loaded_histbook = next->histbook;
+  publish_(std::move(next));
   return loaded_histbook;
 }
 
+void HistBook::saveShards(const std::filesystem::path &name) {
+  const std::shared_ptr<const Snapshot> current = current_();
+  const int count = current->shards.size();
+  for (int i{0}; i < count; i++)
+    writeHistBook_(shardPath_(name, i), *current, i);
+  // Shards left over from saving with more partitions
+  for (int i{count}; std::filesystem::exists(shardPath_(name, i)); i++)
+    std::filesystem::remove(shardPath_(name, i));
+}
+
+bool HistBook::loadShards(const std::filesystem::path &name) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  auto next = std::make_shared<Snapshot>();
+  int count = 0;
+  for (; std::filesystem::exists(shardPath_(name, count)); count++) {
+    if (!readHistBook_(shardPath_(name, count), *next))
+      return false;
+  }
+  if (count == 0) {
+    std::cout << "ERROR: No shards of " << histBookPath_(name) << std::endl;
+    return false;
+  }
+
+  word_occurances = next->word_occurances;
+  histbook_size = next->histbook_size;
+  publish_(std::move(next));
+  return true;
+}
+
 std::vector<std::string> HistBook::KNMatcher(const cv::Mat &query_image,
-                                             const int &k) {
-  std::vector<int> histogram = computeHist(query_image);
-  std::vector<double> tfidf_hist = TF_IDF_(histogram);
-  std::vector<std::string> kmatches = KNMatcher_(tfidf_hist, k);
-  return kmatches;
+                                             const int &k) const {
+  Scratch &buffers = scratch();
+  computeHist(query_image, buffers.histogram);
+  return KNMatcher_(buffers.histogram, k);
 }
 
 std::vector<std::string>
-HistBook::KNMatcher(const std::filesystem::path &filename, const int &k) {
+HistBook::KNMatcher(const std::filesystem::path &filename,
+                    const int &k) const {
   auto file = filename;
   if (filename.filename() == filename) {
     auto path = data_path;
     file = (path /= filename);
   }
-  cv::Mat query_image = cv::imread(file);
-  std::vector<int> histogram = computeHist(query_image);
-  std::vector<double> tfidf_hist = TF_IDF_(histogram);
-  std::vector<std::string> kmatches = KNMatcher_(tfidf_hist, k);
-  return kmatches;
-}
\ No newline at end of file
+  Scratch &buffers = scratch();
+  computeHist(file, buffers.histogram);
+  return KNMatcher_(buffers.histogram, k);
+}
+
+std::vector<std::string>
+HistBook::KNMatcherDescriptors(const cv::Mat &descriptors,
+                               const int &k) const {
+  Scratch &buffers = scratch();
+  computeHist_(descriptors, buffers.histogram);
+  return KNMatcher_(buffers.histogram, k);
+}
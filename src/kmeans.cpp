@@ -0,0 +1,502 @@
+#include "kmeans.hpp"
+#include "hash.hpp"
+#include "serialization.hpp"
+#include <opencv2/core/hal/hal.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+namespace {
+// Partial sums are kept per block of rows and reduced in block order. The
+// block count depends only on the problem size, never on the thread count.
+constexpr int block_rows = 65536;
+constexpr size_t max_partial_bytes = size_t(256) << 20;
+
+int numBlocks(const int &rows, const int &k, const int &dims) {
+  const size_t block_bytes = sizeof(double) * (size_t(k) * dims + k);
+  const int memory_cap =
+      static_cast<int>(std::max<size_t>(1, max_partial_bytes / block_bytes));
+  return std::max(1, std::min({rows / block_rows, memory_cap, 64}));
+}
+
+// Same interpretation of the criteria as cv::kmeans
+int maxIter(const cv::TermCriteria &criteria) {
+  return (criteria.type & cv::TermCriteria::COUNT) ? criteria.maxCount : 100;
+}
+
+double epsilonSqr(const cv::TermCriteria &criteria) {
+  return (criteria.type & cv::TermCriteria::EPS)
+             ? criteria.epsilon * criteria.epsilon
+             : 0.0;
+}
+} // namespace
+
+double KMeans::accumulate(const cv::Mat &data, const cv::Mat &centers,
+                          cv::Mat &labels, cv::Mat &dists, cv::Mat &sums,
+                          cv::Mat &counts, const cv::Mat &weights) {
+  const int rows = data.rows, dims = data.cols, k = centers.rows;
+  labels.create(rows, 1, CV_32S);
+  dists.create(rows, 1, CV_32F);
+
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+    for (int i = range.start; i < range.end; i++) {
+      const float *x = data.ptr<float>(i);
+      int best = 0;
+      float best_dist = FLT_MAX;
+      for (int c{0}; c < k; c++) {
+        float dist = cv::hal::normL2Sqr_(x, centers.ptr<float>(c), dims);
+        if (dist < best_dist) {
+          best_dist = dist;
+          best = c;
+        }
+      }
+      labels.at<int>(i) = best;
+      dists.at<float>(i) = best_dist;
+    }
+  });
+
+  return reduce_(data, labels, dists, weights, k, sums, counts);
+}
+
+double KMeans::reduce_(const cv::Mat &data, const cv::Mat &labels,
+                       const cv::Mat &dists, const cv::Mat &weights,
+                       const int &k, cv::Mat &sums, cv::Mat &counts) {
+  const int rows = data.rows, dims = data.cols;
+  const int blocks = numBlocks(rows, k, dims);
+  std::vector<cv::Mat> partial_sums(blocks), partial_counts(blocks);
+  std::vector<double> partial_compactness(blocks, 0.0);
+
+  cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range) {
+    for (int b = range.start; b < range.end; b++) {
+      cv::Mat block_sums = cv::Mat::zeros(k, dims, CV_64F);
+      cv::Mat block_counts = cv::Mat::zeros(k, 1, CV_64F);
+      const int start = static_cast<int>(int64_t(rows) * b / blocks);
+      const int end = static_cast<int>(int64_t(rows) * (b + 1) / blocks);
+      double compactness = 0.0;
+      for (int i = start; i < end; i++) {
+        const int label = labels.at<int>(i);
+        const double weight = weights.empty() ? 1.0 : weights.at<float>(i);
+        const float *x = data.ptr<float>(i);
+        double *sum = block_sums.ptr<double>(label);
+        for (int j{0}; j < dims; j++)
+          sum[j] += weight * x[j];
+        block_counts.at<double>(label) += weight;
+        compactness += weight * dists.at<float>(i);
+      }
+      partial_sums.at(b) = block_sums;
+      partial_counts.at(b) = block_counts;
+      partial_compactness.at(b) = compactness;
+    }
+  });
+
+  sums = partial_sums.at(0);
+  counts = partial_counts.at(0);
+  double compactness = partial_compactness.at(0);
+  for (int b{1}; b < blocks; b++) {
+    sums += partial_sums.at(b);
+    counts += partial_counts.at(b);
+    compactness += partial_compactness.at(b);
+  }
+  return compactness;
+}
+
+double KMeans::update(const cv::Mat &sums, const cv::Mat &counts,
+                      cv::Mat &centers) {
+  double max_shift = 0.0;
+  for (int c{0}; c < centers.rows; c++) {
+    const double count = counts.at<double>(c);
+    if (count <= 0.0)
+      continue;
+    const double *sum = sums.ptr<double>(c);
+    float *center = centers.ptr<float>(c);
+    double shift = 0.0;
+    for (int j{0}; j < centers.cols; j++) {
+      const float value = static_cast<float>(sum[j] / count);
+      shift += (double(value) - center[j]) * (double(value) - center[j]);
+      center[j] = value;
+    }
+    max_shift = std::max(max_shift, shift);
+  }
+  return max_shift;
+}
+
+void KMeans::initPP_(const cv::Mat &data, const cv::Mat &weights,
+                     cv::Mat &centers, cv::RNG &rng) const {
+  const int rows = data.rows, dims = data.cols;
+  centers.create(params.num_clusters, dims, CV_32F);
+
+  std::vector<float> dists(rows);
+  auto updateDists = [&](const int &c, const bool &first) {
+    const float *center = centers.ptr<float>(c);
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+      for (int i = range.start; i < range.end; i++) {
+        float dist = cv::hal::normL2Sqr_(data.ptr<float>(i), center, dims);
+        dists[i] = first ? dist : std::min(dists[i], dist);
+      }
+    });
+  };
+
+  data.row(rng.uniform(0, rows)).copyTo(centers.row(0));
+  updateDists(0, true);
+
+  for (int c{1}; c < params.num_clusters; c++) {
+    auto weighted = [&](const int &i) {
+      return weights.empty() ? double(dists[i])
+                             : double(dists[i]) * weights.at<float>(i);
+    };
+    double total = 0.0;
+    for (int i{0}; i < rows; i++)
+      total += weighted(i);
+
+    // Sample the next center with probability proportional to w * D^2
+    const double target = rng.uniform(0.0, total);
+    double cumulative = 0.0;
+    int idx = rows - 1;
+    for (int i{0}; i < rows; i++) {
+      cumulative += weighted(i);
+      if (cumulative > target) {
+        idx = i;
+        break;
+      }
+    }
+    data.row(idx).copyTo(centers.row(c));
+    updateDists(c, false);
+  }
+}
+
+void KMeans::initRandom_(const cv::Mat &data, cv::Mat &centers,
+                         cv::RNG &rng) const {
+  const int rows = data.rows;
+  centers.create(params.num_clusters, data.cols, CV_32F);
+
+  // Partial Fisher-Yates shuffle picks distinct rows
+  std::vector<int> order(rows);
+  for (int i{0}; i < rows; i++)
+    order[i] = i;
+  for (int c{0}; c < params.num_clusters; c++) {
+    std::swap(order[c], order[rng.uniform(c, rows)]);
+    data.row(order[c]).copyTo(centers.row(c));
+  }
+}
+
+uint64_t KMeans::deriveSeed(const uint64_t &seed, const uint64_t &i) {
+  uint64_t z = seed + (i + 1) * 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+uint64_t KMeans::fingerprint(const cv::Mat &mat) {
+  const int header[3]{mat.rows, mat.cols, mat.type()};
+  uint64_t hash = Hash::fnv1a(header, sizeof(header));
+  const size_t row_size = mat.cols * mat.elemSize();
+  for (int i{0}; i < mat.rows; i++)
+    hash = Hash::fnv1a(mat.ptr(i), row_size, hash);
+  return hash;
+}
+
+std::filesystem::path KMeans::checkpointPath_(const int &attempt) const {
+  auto path = params.checkpoint;
+  path += "_attempt" + std::to_string(attempt) + ".bin";
+  return path;
+}
+
+uint64_t KMeans::paramsHash_() const {
+  std::vector<double> settings{static_cast<double>(params.algorithm),
+                               static_cast<double>(params.criteria.type),
+                               static_cast<double>(params.criteria.maxCount),
+                               params.criteria.epsilon,
+                               static_cast<double>(params.flags),
+                               static_cast<double>(params.seed)};
+  return fingerprint(cv::Mat(1, static_cast<int>(settings.size()), CV_64F,
+                             settings.data()));
+}
+
+bool KMeans::checkpointDue_(const int &iteration) const {
+  return params.checkpoint_interval > 0 &&
+         iteration % params.checkpoint_interval == 0;
+}
+
+void KMeans::saveCheckpoint_(const int &attempt, const uint64_t &data_hash,
+                             const cv::Mat &centers, const int &iteration,
+                             const bool &converged) const {
+  if (params.checkpoint.empty() || params.checkpoint_interval <= 0)
+    return;
+
+  // Write then rename so that a crash never leaves a truncated checkpoint
+  const auto path = checkpointPath_(attempt);
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+  {
+    std::ofstream file(tmp_path.c_str(), std::ios::binary);
+    cereal::BinaryOutputArchive ar(file);
+    ar(data_hash, paramsHash_(), params.num_clusters, iteration, converged,
+       centers);
+  }
+  std::filesystem::rename(tmp_path, path);
+}
+
+bool KMeans::loadCheckpoint_(const int &attempt, const uint64_t &data_hash,
+                             cv::Mat &centers, int &iteration,
+                             bool &converged) const {
+  if (params.checkpoint.empty() || params.checkpoint_interval <= 0)
+    return false;
+  const auto path = checkpointPath_(attempt);
+  if (!std::filesystem::exists(path))
+    return false;
+
+  uint64_t saved_hash, saved_params;
+  int num_clusters;
+  cv::Mat saved_centers;
+  try {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    cereal::BinaryInputArchive ar(file);
+    ar(saved_hash, saved_params, num_clusters, iteration, converged,
+       saved_centers);
+  } catch (const std::exception &e) {
+    std::cout << "Ignoring checkpoint " << path << " - " << e.what()
+              << std::endl;
+    return false;
+  }
+
+  if (saved_hash != data_hash || saved_params != paramsHash_() ||
+      num_clusters != params.num_clusters) {
+    std::cout << "Ignoring checkpoint " << path
+              << " - it was written for different data or settings"
+              << std::endl;
+    return false;
+  }
+  centers = saved_centers;
+  return true;
+}
+
+void KMeans::removeCheckpoints() const {
+  if (params.checkpoint.empty())
+    return;
+  for (int a{0}; a < std::max(1, params.attempts); a++)
+    std::filesystem::remove(checkpointPath_(a));
+}
+
+void KMeans::seedCenters(const cv::Mat &data, cv::Mat &centers,
+                         const cv::Mat &weights) const {
+  cv::Mat samples = data;
+  if (data.type() != CV_32F || !data.isContinuous())
+    data.convertTo(samples, CV_32F);
+
+  cv::RNG rng(deriveSeed(params.seed, 0));
+  if (params.flags & cv::KMEANS_PP_CENTERS)
+    initPP_(samples, weights, centers, rng);
+  else
+    initRandom_(samples, centers, rng);
+}
+
+double KMeans::run_(const cv::Mat &data, const cv::Mat &weights,
+                    cv::Mat &labels, cv::Mat &centers, cv::RNG &rng,
+                    const int &attempt, const uint64_t &data_hash) const {
+  int start_iter = 0;
+  bool converged = false;
+  if (loadCheckpoint_(attempt, data_hash, centers, start_iter, converged)) {
+    std::cout << "Resuming attempt " << attempt << " at iteration "
+              << start_iter << std::endl;
+  } else {
+    if (attempt == 0 && !params.initial_centers.empty())
+      params.initial_centers.convertTo(centers, CV_32F);
+    else if (params.flags & cv::KMEANS_PP_CENTERS)
+      initPP_(data, weights, centers, rng);
+    else
+      initRandom_(data, centers, rng);
+    // Seeding large vocabularies is expensive, keep it
+    saveCheckpoint_(attempt, data_hash, centers, 0, false);
+  }
+
+  if (params.algorithm == HAMERLY)
+    return runHamerly_(data, weights, labels, centers, attempt, data_hash,
+                       start_iter, converged);
+
+  const int max_iter = maxIter(params.criteria);
+  const double epsilon = epsilonSqr(params.criteria);
+
+  cv::Mat dists, sums, counts;
+  double compactness = 0.0;
+  for (int iter{start_iter};; iter++) {
+    compactness =
+        accumulate(data, centers, labels, dists, sums, counts, weights);
+    if (iter >= max_iter || converged) {
+      saveCheckpoint_(attempt, data_hash, centers, iter, true);
+      break;
+    }
+    converged = update(sums, counts, centers) <= epsilon;
+    if (checkpointDue_(iter + 1))
+      saveCheckpoint_(attempt, data_hash, centers, iter + 1, converged);
+  }
+  return compactness;
+}
+
+// Hamerly's algorithm: upper[i] bounds the distance from row i to its
+// center, lower[i] the distance to every other center. A row is only
+// rescanned when its upper bound exceeds max(lower[i], half the distance from
+// its center to the closest other center).
+double KMeans::runHamerly_(const cv::Mat &data, const cv::Mat &weights,
+                           cv::Mat &labels, cv::Mat &centers,
+                           const int &attempt, const uint64_t &data_hash,
+                           const int &start_iter, bool converged) const {
+  const int rows = data.rows, dims = data.cols, k = centers.rows;
+  const int max_iter = maxIter(params.criteria);
+  const double epsilon = epsilonSqr(params.criteria);
+
+  labels.create(rows, 1, CV_32S);
+  std::vector<double> upper(rows), lower(rows);
+  std::vector<double> half_gap(k), moved(k);
+
+  // Exact nearest and second nearest center of row i
+  auto scan = [&](const int &i) {
+    const float *x = data.ptr<float>(i);
+    double best = DBL_MAX, second = DBL_MAX;
+    int best_idx = 0;
+    for (int c{0}; c < k; c++) {
+      double dist = cv::hal::normL2Sqr_(x, centers.ptr<float>(c), dims);
+      if (dist < best) {
+        second = best;
+        best = dist;
+        best_idx = c;
+      } else if (dist < second) {
+        second = dist;
+      }
+    }
+    labels.at<int>(i) = best_idx;
+    upper[i] = std::sqrt(best);
+    lower[i] = std::sqrt(second);
+  };
+
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+    for (int i = range.start; i < range.end; i++)
+      scan(i);
+  });
+
+  cv::Mat dists(rows, 1, CV_32F, cv::Scalar(0)), sums, counts;
+  for (int iter{start_iter}; iter < max_iter && !converged; iter++) {
+    reduce_(data, labels, dists, weights, k, sums, counts);
+    cv::Mat previous = centers.clone();
+    converged = update(sums, counts, centers) <= epsilon;
+
+    int farthest = 0;
+    for (int c{0}; c < k; c++) {
+      moved[c] = std::sqrt(cv::hal::normL2Sqr_(
+          previous.ptr<float>(c), centers.ptr<float>(c), dims));
+      if (moved[c] > moved[farthest])
+        farthest = c;
+    }
+    double second_farthest = 0.0;
+    for (int c{0}; c < k; c++)
+      if (c != farthest)
+        second_farthest = std::max(second_farthest, moved[c]);
+
+    // Half the distance between two centers shrinks by at most half of what
+    // they moved, so only centers that moved are measured against the
+    // others. The rest keep a lowered bound, which is still valid.
+    cv::parallel_for_(cv::Range(0, k), [&](const cv::Range &range) {
+      for (int c = range.start; c < range.end; c++) {
+        if (iter != start_iter && moved[c] == 0.0) {
+          half_gap[c] -= 0.5 * (c == farthest ? second_farthest
+                                              : moved[farthest]);
+          continue;
+        }
+        double closest = DBL_MAX;
+        for (int other{0}; other < k; other++) {
+          if (other != c)
+            closest = std::min(
+                closest, double(cv::hal::normL2Sqr_(centers.ptr<float>(c),
+                                                    centers.ptr<float>(other),
+                                                    dims)));
+        }
+        half_gap[c] = 0.5 * std::sqrt(closest);
+      }
+    });
+
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+      for (int i = range.start; i < range.end; i++) {
+        const int label = labels.at<int>(i);
+        upper[i] += moved[label];
+        lower[i] -= label == farthest ? second_farthest : moved[farthest];
+
+        // Strict, so ties are rescanned and resolved like in Lloyd
+        const double bound = std::max(half_gap[label], lower[i]);
+        if (upper[i] < bound)
+          continue;
+        upper[i] = std::sqrt(cv::hal::normL2Sqr_(
+            data.ptr<float>(i), centers.ptr<float>(label), dims));
+        if (upper[i] < bound)
+          continue;
+        scan(i);
+      }
+    });
+
+    if (checkpointDue_(iter + 1))
+      saveCheckpoint_(attempt, data_hash, centers, iter + 1, converged);
+  }
+  saveCheckpoint_(attempt, data_hash, centers, max_iter, true);
+
+  // Bounds are not exact distances, compute the compactness directly
+  double compactness = 0.0;
+  for (int i{0}; i < rows; i++) {
+    const double weight = weights.empty() ? 1.0 : weights.at<float>(i);
+    compactness += weight * cv::hal::normL2Sqr_(
+                                data.ptr<float>(i),
+                                centers.ptr<float>(labels.at<int>(i)), dims);
+  }
+  return compactness;
+}
+
+double KMeans::fit(const cv::Mat &data, cv::Mat &labels, cv::Mat &centers,
+                   const cv::Mat &weights) const {
+  if (params.num_clusters <= 0 || data.rows < params.num_clusters) {
+    std::cout << "ERROR: Not enough samples for " << params.num_clusters
+              << " clusters" << std::endl;
+    return -1.0;
+  }
+
+  cv::Mat samples = data;
+  if (data.type() != CV_32F || !data.isContinuous())
+    data.convertTo(samples, CV_32F);
+  if (!weights.empty() && (weights.total() != size_t(data.rows) ||
+                           weights.type() != CV_32F)) {
+    std::cout << "ERROR: Expected one CV_32F weight per row" << std::endl;
+    return -1.0;
+  }
+
+  const int attempts = std::max(1, params.attempts);
+  std::vector<uint64_t> seeds(attempts);
+  for (int a{0}; a < attempts; a++)
+    seeds.at(a) = deriveSeed(params.seed, a);
+
+  const uint64_t data_hash =
+      params.checkpoint.empty() ? 0 : fingerprint(samples);
+
+  std::vector<cv::Mat> attempt_labels(attempts), attempt_centers(attempts);
+  std::vector<double> compactness(attempts);
+
+  // Each attempt gets its own thread; their parallel_for_ regions share the
+  // OpenCV thread pool
+  std::vector<std::thread> workers;
+  for (int a{0}; a < attempts; a++) {
+    workers.emplace_back([&, a] {
+      cv::RNG rng(seeds.at(a));
+      compactness.at(a) = run_(samples, weights, attempt_labels.at(a),
+                               attempt_centers.at(a), rng, a, data_hash);
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+
+  const int best = static_cast<int>(
+      std::min_element(compactness.begin(), compactness.end()) -
+      compactness.begin());
+  labels = attempt_labels.at(best);
+  centers = attempt_centers.at(best);
+  return compactness.at(best);
+}
@@ -18,16 +18,19 @@ int main() {
   std::filesystem::path image_path = data_path;
   image_path /= image_name;
 
-  cv::Mat query_image = cv::imread(image_path, cv::IMREAD_COLOR);
-
-  CodeBook codebook{data_path};
-  codebook.load("codebook"); // Load pre-computed codebook
-  cv::Mat mycodebook = codebook.get();
-
-  HistBook histbook(mycodebook, data_path);
-  histbook.load("histbook"); // Load saved histbook
+  HistBook histbook(data_path);
+  // Load pre-computed codebook, its projection, quantizer index and the
+  // extraction settings the query image is read and extracted with
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+  // Load saved histbook. Refused if it was built with another codebook.
+  if (histbook.load("histbook").empty()) {
+    std::cout << "ERROR: No histbook for this codebook, run preprocess"
+              << std::endl;
+    return 1;
+  }
 
-  std::vector<std::string> kmatches = histbook.KNMatcher(query_image, k);
+  std::vector<std::string> kmatches = histbook.KNMatcher(image_path, k);
 
   for (const auto &match : kmatches) {
     std::cout << match << std::endl;
@@ -0,0 +1,180 @@
+#include "manifest.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include <unistd.h>
+
+namespace {
+// 2 added the extraction settings hash, 3 the extraction settings
+const int manifest_version = 3;
+} // namespace
+
+Mat::Manifest::Manifest(const std::filesystem::path &data_path,
+                        const std::filesystem::path &binary_path,
+                        const std::string &ext)
+    : data_path{data_path}, binary_path{binary_path}, ext{ext} {}
+
+Mat::Manifest Mat::Manifest::open(const std::filesystem::path &data_path,
+                                  const std::filesystem::path &binary_path,
+                                  const std::string &ext) {
+  Manifest manifest(data_path, binary_path, ext);
+  if (!manifest.load()) {
+    manifest.refresh();
+    manifest.save();
+  }
+  return manifest;
+}
+
+std::filesystem::path Mat::Manifest::path() const {
+  std::string name = "manifest" + ext;
+  std::replace(name.begin(), name.end(), '.', '_');
+  auto path = binary_path;
+  path /= name + ".bin";
+  return path;
+}
+
+std::vector<std::string>
+Mat::Manifest::savedExts(const std::filesystem::path &binary_path) {
+  std::vector<std::string> exts;
+  if (!std::filesystem::is_directory(binary_path))
+    return exts;
+  for (const auto &file : std::filesystem::directory_iterator(binary_path)) {
+    const std::string name = file.path().filename().string();
+    if (!file.is_regular_file() || name.rfind("manifest", 0) != 0 ||
+        file.path().extension() != ".bin")
+      continue;
+    std::ifstream in(file.path().c_str(), std::ios::binary);
+    try {
+      cereal::BinaryInputArchive ar(in);
+      int version;
+      std::string saved_ext;
+      ar(version, saved_ext);
+      // Only files that are the manifest of their own extension
+      if (version == manifest_version &&
+          Manifest({}, binary_path, saved_ext).path() == file.path())
+        exts.emplace_back(saved_ext);
+    } catch (const std::exception &) {
+      // Not a manifest
+    }
+  }
+  std::sort(exts.begin(), exts.end());
+  return exts;
+}
+
+bool Mat::Manifest::load() {
+  std::ifstream file(path().c_str(), std::ios::binary);
+  if (!file)
+    return false;
+  try {
+    cereal::BinaryInputArchive ar(file);
+    int version;
+    std::string saved_ext;
+    ar(version, saved_ext);
+    if (version != manifest_version || saved_ext != ext)
+      return false;
+    ar(settings, extraction, entries);
+  } catch (const std::exception &e) {
+    std::cout << "ERROR: Could not read manifest " << path() << ": "
+              << e.what() << std::endl;
+    entries.clear();
+    return false;
+  }
+  return true;
+}
+
+void Mat::Manifest::save() {
+  updateOffsets_();
+  // Written next to the manifest and renamed so readers never see a partial
+  // file. The temporary name is unique per process and thread, as stages
+  // running in parallel may all create the manifest on first use.
+  auto tmp_path = path();
+  tmp_path += ".tmp" + std::to_string(::getpid()) + "_" +
+              std::to_string(
+                  std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  {
+    std::ofstream file(tmp_path.c_str(), std::ios::binary);
+    cereal::BinaryOutputArchive ar(file);
+    ar(manifest_version, ext, settings, extraction, entries);
+  }
+  std::error_code error;
+  std::filesystem::rename(tmp_path, path(), error);
+  if (error) {
+    std::cout << "ERROR: Could not save manifest " << path() << ": "
+              << error.message() << std::endl;
+    std::filesystem::remove(tmp_path, error);
+  }
+}
+
+std::vector<size_t> Mat::Manifest::refresh() {
+  if (!std::filesystem::is_directory(data_path)) {
+    std::cout << "Error: Invalid Path" << std::endl;
+    entries.clear();
+    return {};
+  }
+
+  std::vector<Entry> scanned;
+  for (const auto &file : std::filesystem::directory_iterator(data_path)) {
+    if (!file.is_regular_file() || file.path().extension() != ext)
+      continue;
+    Entry entry;
+    entry.filename = file.path().filename().string();
+    entry.size = file.file_size();
+    entry.mtime = file.last_write_time().time_since_epoch().count();
+    scanned.emplace_back(std::move(entry));
+  }
+  std::sort(scanned.begin(), scanned.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.filename < b.filename;
+            });
+
+  // Both lists are sorted, so unchanged entries are found in one merge pass
+  std::vector<size_t> changed;
+  size_t old_idx = 0;
+  for (size_t i{0}; i < scanned.size(); i++) {
+    auto &entry = scanned.at(i);
+    while (old_idx < entries.size() &&
+           entries.at(old_idx).filename < entry.filename)
+      old_idx++;
+    if (old_idx < entries.size() &&
+        entries.at(old_idx).filename == entry.filename &&
+        entries.at(old_idx).size == entry.size &&
+        entries.at(old_idx).mtime == entry.mtime)
+      entry.descriptors = entries.at(old_idx).descriptors;
+    else
+      changed.emplace_back(i);
+  }
+  entries = std::move(scanned);
+  updateOffsets_();
+  return changed;
+}
+
+void Mat::Manifest::setDescriptors(const size_t &i, const int64_t &rows) {
+  entries.at(i).descriptors = rows;
+}
+
+void Mat::Manifest::updateOffsets_() {
+  uint64_t offset = 0;
+  for (auto &entry : entries) {
+    entry.offset = offset;
+    offset += std::max<int64_t>(0, entry.descriptors);
+  }
+}
+
+std::filesystem::path Mat::Manifest::imagePath(const size_t &i) const {
+  auto path = data_path;
+  path /= entries.at(i).filename;
+  return path;
+}
+
+std::vector<std::filesystem::path>
+Mat::Manifest::binNames(const std::string &suffix) const {
+  std::vector<std::filesystem::path> names;
+  names.reserve(entries.size());
+  for (const auto &entry : entries)
+    names.emplace_back(entry.stem() + suffix);
+  return names;
+}
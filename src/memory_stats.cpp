@@ -0,0 +1,130 @@
+#include "memory_stats.hpp"
+
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+namespace {
+// Reads a "<field>: <value> kB" line of /proc/self/status
+size_t statusField(const std::string &field) {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, field.size(), field) == 0 &&
+        line[field.size()] == ':') {
+      std::istringstream value(line.substr(field.size() + 1));
+      size_t kb = 0;
+      value >> kb;
+      return kb * 1024;
+    }
+  }
+  return 0;
+}
+// Stages currently open and started so far, across all threads
+std::mutex stages_mutex;
+int open_stages = 0;
+uint64_t started_stages = 0;
+} // namespace
+
+size_t Memory::currentRSS() { return statusField("VmRSS"); }
+
+size_t Memory::peakRSS() { return statusField("VmHWM"); }
+
+bool Memory::resetPeakRSS() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5";
+  clear_refs.flush();
+  return static_cast<bool>(clear_refs);
+}
+
+Memory::Profiler &Memory::Profiler::instance() {
+  static Profiler profiler;
+  return profiler;
+}
+
+void Memory::Profiler::record(const StageStats &stats) {
+  std::lock_guard<std::mutex> lock(mutex);
+  stages.emplace_back(stats);
+}
+
+std::vector<Memory::StageStats> Memory::Profiler::getStages() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stages;
+}
+
+void Memory::Profiler::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  stages.clear();
+}
+
+void Memory::Profiler::report(std::ostream &out) const {
+  const double mb = 1024.0 * 1024.0;
+  // Leaves the caller's stream formatting as it was
+  const std::ios_base::fmtflags flags = out.flags();
+  const std::streamsize precision = out.precision();
+  out << std::left << std::setw(28) << "stage" << std::right << std::setw(12)
+      << "wall_ms" << std::setw(12) << "rss_mb" << std::setw(12) << "peak_mb"
+      << "\n";
+  for (const auto &stage : getStages()) {
+    out << std::left << std::setw(28) << stage.name << std::right
+        << std::fixed << std::setprecision(1) << std::setw(12)
+        << stage.wall_ms << std::setw(12) << stage.rss_after / mb
+        << std::setw(12) << stage.peak_rss / mb << "\n";
+    for (const auto &[name, size] : stage.structures)
+      out << "  " << std::left << std::setw(26) << name << std::right
+          << std::setw(36) << size / mb << "\n";
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
+
+void Memory::Profiler::saveJSON(const std::filesystem::path &path) const {
+  std::ofstream out{path.c_str()};
+  out << "{\"stages\": [";
+  bool first_stage = true;
+  for (const auto &stage : getStages()) {
+    out << (first_stage ? "" : ",") << "\n  {\"name\": \"" << stage.name
+        << "\", \"wall_ms\": " << stage.wall_ms
+        << ", \"rss_before\": " << stage.rss_before
+        << ", \"rss_after\": " << stage.rss_after
+        << ", \"peak_rss\": " << stage.peak_rss
+        << ", \"peak_is_per_stage\": "
+        << (stage.peak_is_per_stage ? "true" : "false")
+        << ", \"structures\": {";
+    bool first_structure = true;
+    for (const auto &[name, size] : stage.structures) {
+      out << (first_structure ? "" : ", ") << "\"" << name << "\": " << size;
+      first_structure = false;
+    }
+    out << "}}";
+    first_stage = false;
+  }
+  out << "\n]}\n";
+}
+
+Memory::Stage::Stage(const std::string &name)
+    : start{std::chrono::steady_clock::now()} {
+  stats.name = name;
+  std::lock_guard<std::mutex> lock(stages_mutex);
+  stats.peak_is_per_stage = open_stages == 0 && resetPeakRSS();
+  open_stages++;
+  started = ++started_stages;
+  stats.rss_before = currentRSS();
+}
+
+Memory::Stage::~Stage() {
+  stats.wall_ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  {
+    std::lock_guard<std::mutex> lock(stages_mutex);
+    stats.rss_after = currentRSS();
+    stats.peak_rss = peakRSS();
+    // Another stage started meanwhile and shares this peak
+    if (started != started_stages)
+      stats.peak_is_per_stage = false;
+    open_stages--;
+  }
+  Profiler::instance().record(stats);
+}
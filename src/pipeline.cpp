@@ -0,0 +1,390 @@
+#include "codebook.hpp"
+#include "hash.hpp"
+#include "histbook.hpp"
+#include "quantizer.hpp"
+#include "serialization.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Configurable version of preprocess + main. The work is split into stages
+// with declared dependencies and outputs:
+//
+//   extract -> codebook -> index ----> query
+//                       \-> histbook -/
+//
+// Every stage has a key hashed from its own settings and the keys of the
+// stages it depends on. A stage whose key matches the stamp left by its last
+// run and whose outputs all exist is skipped. Stages start as soon as their
+// dependencies are done, so index and histbook run in parallel. A stage
+// fails by throwing, which leaves its stamp untouched. Peak RSS reported by
+// Memory::Stage is only per stage for stages that ran alone.
+//
+// Settings come from a config file of key = value lines and/or key=value
+// arguments, later ones overriding earlier ones:
+//   pipeline [config] [key=value ...]
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Config = std::map<std::string, std::string>;
+
+const Config defaults{{"data_path", "../data/kitti_Seq/Kitti_Seq_07"},
+                      {"ext", ".png"},
+                      {"num_words", "1500"},
+                      {"projection_dims", "64"},
+                      {"root_sift", "1"},
+                      {"max_features", "1000"},
+                      {"grid_rows", "4"},
+                      {"grid_cols", "4"},
+                      {"read_mode", "grayscale"},
+                      {"target_width", "0"},
+                      {"max_samples", "0"},
+                      {"seed", "42"},
+                      {"low_memory", "1"},
+                      {"query", ""},
+                      {"k", "20"}};
+
+std::string trim(const std::string &str) {
+  const auto begin = str.find_first_not_of(" \t");
+  if (begin == std::string::npos)
+    return "";
+  const auto end = str.find_last_not_of(" \t\r");
+  return str.substr(begin, end - begin + 1);
+}
+
+// Parses "key = value". Returns false for anything else.
+bool parseSetting(const std::string &line, Config &config) {
+  const auto pos = line.find('=');
+  if (pos == std::string::npos)
+    return false;
+  const std::string key = trim(line.substr(0, pos));
+  if (!defaults.count(key)) {
+    std::cout << "ERROR: Unknown setting " << key << std::endl;
+    return false;
+  }
+  config[key] = trim(line.substr(pos + 1));
+  return true;
+}
+
+bool readConfig(const fs::path &path, Config &config) {
+  std::ifstream file(path.c_str());
+  if (!file) {
+    std::cout << "ERROR: Could not read " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    line = trim(line.substr(0, line.find('#')));
+    if (!line.empty() && !parseSetting(line, config))
+      return false;
+  }
+  return true;
+}
+
+int readMode(const std::string &name) {
+  if (name == "color")
+    return cv::IMREAD_COLOR;
+  if (name == "reduced_2")
+    return cv::IMREAD_REDUCED_GRAYSCALE_2;
+  if (name == "reduced_4")
+    return cv::IMREAD_REDUCED_GRAYSCALE_4;
+  return cv::IMREAD_GRAYSCALE;
+}
+
+struct Stage {
+  std::string name;
+  std::vector<std::string> depends;
+  // Settings the stage output depends on
+  std::vector<std::string> settings;
+  // Files the stage produces. A stage without outputs always runs.
+  std::vector<fs::path> outputs;
+  std::function<void()> run;
+  // Extra state folded into the key, e.g. the image folder contents
+  std::function<std::string()> state;
+};
+
+struct Result {
+  uint64_t key{0};
+  bool ran{false};
+  bool ok{true};
+  double ms{0.0};
+};
+
+class Pipeline {
+private:
+  Config config;
+  fs::path stamp_path;
+  std::vector<Stage> stages;
+  std::map<std::string, std::shared_future<Result>> results;
+  std::mutex print_mutex;
+
+  fs::path stampFile_(const std::string &name) const {
+    auto path = stamp_path;
+    path /= "pipeline_" + name + ".stamp";
+    return path;
+  }
+
+  bool upToDate_(const Stage &stage, const uint64_t &key) const {
+    if (stage.outputs.empty())
+      return false;
+    for (const auto &output : stage.outputs) {
+      if (!fs::exists(output))
+        return false;
+    }
+    std::ifstream stamp(stampFile_(stage.name).c_str());
+    uint64_t saved = 0;
+    return static_cast<bool>(stamp >> std::hex >> saved) && saved == key;
+  }
+
+  Result run_(const Stage &stage) {
+    Result result;
+    uint64_t key = Hash::fnv1a(stage.name);
+    for (const auto &dependency : stage.depends) {
+      const Result &input = results.at(dependency).get();
+      if (!input.ok) {
+        result.ok = false;
+        return result;
+      }
+      key = Hash::fnv1a(std::to_string(input.key), key);
+    }
+    for (const auto &setting : stage.settings)
+      key = Hash::fnv1a(setting + "=" + config.at(setting), key);
+    if (stage.state)
+      key = Hash::fnv1a(stage.state(), key);
+    result.key = key;
+
+    if (upToDate_(stage, key))
+      return result;
+
+    auto start = Clock::now();
+    try {
+      stage.run();
+    } catch (const std::exception &e) {
+      std::lock_guard<std::mutex> lock(print_mutex);
+      std::cout << "ERROR: Stage " << stage.name << " failed: " << e.what()
+                << std::endl;
+      result.ok = false;
+      return result;
+    }
+    result.ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    result.ran = true;
+
+    std::ofstream stamp(stampFile_(stage.name).c_str());
+    stamp << std::hex << std::setw(16) << std::setfill('0') << key << "\n";
+    return result;
+  }
+
+public:
+  Pipeline(const Config &config, const fs::path &stamp_path)
+      : config{config}, stamp_path{stamp_path} {}
+
+  // Stages must be added after the stages they depend on
+  void add(const Stage &stage) { stages.emplace_back(stage); }
+
+  bool run() {
+    // All futures exist before any stage starts looking up its dependencies.
+    // Each stage then waits for them on its own thread.
+    std::vector<std::packaged_task<Result()>> tasks;
+    for (const auto &stage : stages) {
+      tasks.emplace_back([this, &stage] { return run_(stage); });
+      results[stage.name] = tasks.back().get_future().share();
+    }
+    std::vector<std::thread> threads;
+    for (auto &task : tasks)
+      threads.emplace_back(std::move(task));
+    for (auto &thread : threads)
+      thread.join();
+
+    bool ok = true;
+    std::cout << "stage\tstatus\twall_ms" << std::endl;
+    for (const auto &stage : stages) {
+      const Result &result = results.at(stage.name).get();
+      ok = ok && result.ok;
+      std::cout << stage.name << "\t"
+                << (!result.ok ? "failed" : result.ran ? "ran" : "up to date")
+                << "\t" << result.ms << std::endl;
+    }
+    return ok;
+  }
+};
+
+const std::vector<std::string> extraction_settings{
+    "ext",       "root_sift", "max_features", "grid_rows",
+    "grid_cols", "read_mode", "target_width"};
+
+// Names, sizes and mtimes of the images, so that extract reruns when the
+// folder changes
+std::string folderState(const Mat::Serialization &serialization,
+                        const std::string &ext) {
+  Mat::Manifest manifest = serialization.manifest(ext);
+  manifest.refresh();
+  std::ostringstream state;
+  for (const auto &entry : manifest.getEntries())
+    state << entry.filename << " " << entry.size << " " << entry.mtime << "\n";
+  return state.str();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Config config = defaults;
+  for (int i{1}; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.find('=') != std::string::npos ? !parseSetting(arg, config)
+                                           : !readConfig(arg, config)) {
+      std::cout << "Usage: pipeline [config] [key=value ...]" << std::endl;
+      return 1;
+    }
+  }
+
+  const fs::path data_path = fs::canonical(config.at("data_path"));
+  const std::string ext = config.at("ext");
+  auto setting = [&config](const std::string &key) {
+    return std::stoi(config.at(key));
+  };
+  const bool root_sift = setting("root_sift") != 0;
+  const bool low_memory = setting("low_memory") != 0;
+  const int read_mode = readMode(config.at("read_mode"));
+
+  Mat::Serialization serialization(data_path);
+  auto bin_path = data_path;
+  bin_path /= "bin";
+  auto bin_file = [&bin_path](const std::string &name) {
+    auto path = bin_path;
+    path /= name;
+    return path;
+  };
+
+  Pipeline pipeline(config, bin_path);
+
+  pipeline.add(
+      {"extract",
+       {},
+       extraction_settings,
+       {serialization.manifest(ext).path()},
+       [&] {
+         Mat::Serialization bins(data_path);
+         // Bins hold raw SIFT, RootSIFT is applied when they are read
+         bins.setEncoding(Mat::Serialization::UINT8, true);
+         bins.setRootSIFT(root_sift);
+         SIFT::Features sift;
+         sift.setRootSIFT(root_sift);
+         sift.setMaxFeatures(setting("max_features"));
+         sift.setGrid(setting("grid_rows"), setting("grid_cols"));
+         sift.setReadMode(read_mode);
+         sift.setTargetWidth(setting("target_width"));
+         const SIFT::Features::Settings extraction = sift.getSettings();
+         sift.setRootSIFT(false);
+
+         // Only new and changed images, unless the settings changed
+         Mat::Manifest manifest = bins.manifest(ext);
+         std::vector<size_t> changed = manifest.refresh();
+         const auto bin_names = manifest.binNames();
+         // Same hash as preprocess, so either can reuse the other's bins
+         const uint64_t settings = bins.binSettings(extraction);
+         for (size_t i{0}; i < manifest.size(); i++) {
+           if (manifest.getSettings() != settings ||
+               !bins.exists(bin_names.at(i)))
+             changed.emplace_back(i);
+         }
+         std::sort(changed.begin(), changed.end());
+         changed.erase(std::unique(changed.begin(), changed.end()),
+                       changed.end());
+         manifest.setSettings(settings);
+         manifest.setExtraction(extraction);
+
+         for (const auto &i : changed) {
+           sift.detectAndExtract(manifest.imagePath(i));
+           bins.serialize(sift.getDescriptors(), bin_names.at(i));
+           manifest.setDescriptors(i, sift.getDescriptors().rows);
+         }
+         manifest.save();
+       },
+       [&] { return folderState(serialization, ext); }});
+
+  pipeline.add({"codebook",
+                {"extract"},
+                {"num_words", "projection_dims", "max_samples", "seed"},
+                {bin_file("codebook.bin")},
+                [&] {
+                  CodeBook codebook(data_path);
+                  codebook.setNumWords(setting("num_words"));
+                  codebook.setProjectionDims(setting("projection_dims"));
+                  codebook.setSeed(std::stoull(config.at("seed")));
+                  codebook.setLowMemory(low_memory);
+                  if (setting("max_samples") > 0)
+                    codebook.setSampling(Sampler::STRATIFIED,
+                                         setting("max_samples"));
+                  codebook.generate(ext);
+                  if (codebook.get().empty())
+                    throw std::runtime_error("No codebook generated");
+                  codebook.save("codebook");
+                }});
+
+  pipeline.add({"index",
+                {"codebook"},
+                {},
+                {bin_file("codebook.flann")},
+                [&] {
+                  Quantizer quantizer(serialization.deserialize("codebook"));
+                  if (!quantizer.save(bin_file("codebook.flann")))
+                    throw std::runtime_error("No index saved");
+                }});
+
+  // Builds its own quantizer rather than reading codebook.flann, which the
+  // index stage may be writing at the same time
+  pipeline.add({"histbook",
+                {"codebook"},
+                {},
+                {data_path / "histbook.txt"},
+                [&] {
+                  CodeBook codebook(data_path);
+                  codebook.load("codebook");
+                  if (codebook.get().empty())
+                    throw std::runtime_error("No codebook");
+                  HistBook histbook(codebook.get(), data_path);
+                  histbook.setExtraction(codebook.getExtraction());
+                  histbook.setProjection(codebook.getProjection());
+                  histbook.setLowMemory(low_memory);
+                  histbook.generate(ext);
+                  if (histbook.getHistBook().empty())
+                    throw std::runtime_error("No histbook generated");
+                  histbook.save("histbook");
+                }});
+
+  if (!config.at("query").empty()) {
+    pipeline.add({"query",
+                  {"index", "histbook"},
+                  {"query", "k"},
+                  {},
+                  [&] {
+                    HistBook histbook(data_path);
+                    if (!histbook.loadCodeBook("codebook") ||
+                        histbook.load("histbook").empty())
+                      throw std::runtime_error("No codebook or histbook");
+                    for (const auto &match : histbook.KNMatcher(
+                             fs::path(config.at("query")), setting("k")))
+                      std::cout << match << std::endl;
+                  }});
+  }
+
+  return pipeline.run() ? 0 : 1;
+}
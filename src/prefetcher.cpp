@@ -0,0 +1,89 @@
+#include "prefetcher.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+Mat::Prefetcher::Prefetcher(const Serialization &serialization,
+                            const std::vector<std::filesystem::path> &names,
+                            const int &depth, const int &num_threads)
+    : serialization{serialization}, names{names},
+      depth{static_cast<size_t>(std::max(1, depth))}, slots(names.size()),
+      ready(names.size(), 0) {
+  // The first batch is hinted here, later ones as reading progresses
+  for (size_t i{0}; i < std::min(this->depth, names.size()); i++)
+    hint_(i);
+  const int threads =
+      std::min(std::max(1, num_threads), static_cast<int>(this->depth));
+  for (int i{0}; i < threads && i < static_cast<int>(names.size()); i++)
+    readers.emplace_back(&Prefetcher::read_, this);
+}
+
+Mat::Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  consumed.notify_all();
+  for (auto &reader : readers)
+    reader.join();
+}
+
+void Mat::Prefetcher::hint_(const size_t &i) const {
+  if (i >= names.size())
+    return;
+  const auto path = serialization.binPath(names.at(i));
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  ::close(fd);
+}
+
+void Mat::Prefetcher::read_() {
+  while (true) {
+    size_t i;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      consumed.wait(lock, [this] {
+        return stop || next_load >= names.size() ||
+               next_load < next_out + depth;
+      });
+      if (stop || next_load >= names.size())
+        return;
+      i = next_load++;
+    }
+    // Keep the kernel one window ahead of the files being read
+    hint_(i + depth);
+
+    cv::Mat mat;
+    try {
+      serialization.deserialize(names.at(i), mat);
+    } catch (const std::exception &e) {
+      std::cout << "ERROR: Could not read " << names.at(i) << ": " << e.what()
+                << std::endl;
+      mat = cv::Mat();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      slots.at(i) = std::move(mat);
+      ready.at(i) = 1;
+    }
+    loaded.notify_all();
+  }
+}
+
+bool Mat::Prefetcher::next(cv::Mat &mat) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (next_out >= names.size())
+    return false;
+  loaded.wait(lock, [this] { return ready.at(next_out) != 0; });
+  mat = std::move(slots.at(next_out));
+  next_out++;
+  lock.unlock();
+  consumed.notify_all();
+  return true;
+}
@@ -2,9 +2,11 @@
 #include "histbook.hpp"
 #include "serialization.hpp"
 
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
 #include <map>
+#include <numeric>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -19,45 +21,130 @@ int main() {
   const std::string image_ext = ".png";
   // const std::string image_ext = ".ppm";
   const std::string suffix = "";
+  const bool root_sift = true;
+  const int projection_dims = 64; // 0 keeps full 128-D SIFT
+  const int max_features = 1000;  // 0 keeps every keypoint
+  const int grid_rows = 4, grid_cols = 4;
+  // SIFT works on grayscale - decode straight to it. Use
+  // IMREAD_REDUCED_GRAYSCALE_2 or a target width for faster extraction.
+  const int read_mode = cv::IMREAD_GRAYSCALE;
+  const int target_width = 0; // 0 keeps full resolution
+  // Descriptors k-means is trained on, drawn evenly from every image.
+  // 0 trains on every descriptor.
+  const int max_samples = 0;
+  // k-means iterations between training checkpoints. 0 disables.
+  const int checkpoint_interval = 1;
+  const uint64_t seed = 42; // Same seed and data give the same codebook
+  // Release training intermediates as soon as each stage is done
+  const bool low_memory = true;
+  // Descriptor bin encoding. SIFT values are integers and pack losslessly
+  // into uint8. Bins hold raw SIFT, RootSIFT is applied when they are read.
+  const auto encoding = Mat::Serialization::UINT8;
+  const bool compress_bins = true;
+  // Extract only new or changed images and update the histbook of the
+  // existing codebook instead of rebuilding everything. Needs the raw
+  // histbook, so the histbook keeps it in memory.
+  const bool incremental = true;
 
   Mat::Serialization serialization(data_path);
+  serialization.setEncoding(encoding, compress_bins);
+  serialization.setRootSIFT(root_sift);
   SIFT::Features sift;
-
-  // Read all images in data folder
-  auto image_path = data_path;
-  (image_path /= "*") += image_ext;
-  std::vector<cv::String> imnames;
-  cv::glob(image_path, imnames, false);
-
-  for (auto &imname : imnames) {
-    const cv::Mat image = cv::imread(imname, cv::IMREAD_COLOR);
-    sift.detectAndExtract(image);
-    cv::Mat descriptor = sift.getDescriptors();
-
-    std::filesystem::path name = imname;
-    name = (name.stem()) += suffix;
-    serialization.serialize(descriptor, name); // Store bin to disk
+  sift.setRootSIFT(root_sift);
+  sift.setMaxFeatures(max_features);
+  sift.setGrid(grid_rows, grid_cols);
+  sift.setReadMode(read_mode);
+  sift.setTargetWidth(target_width);
+  // Saved with the manifest and codebook, queries extract with these
+  const SIFT::Features::Settings extraction = sift.getSettings();
+  sift.setRootSIFT(false); // Applied when the bins are read
+
+  // Bins extracted with other settings cannot be reused
+  const uint64_t settings = serialization.binSettings(extraction);
+
+  // Scan the data folder once. Later stages read the saved manifest.
+  Mat::Manifest manifest = serialization.manifest(image_ext);
+  std::vector<size_t> changed = manifest.refresh();
+  const auto bin_names = manifest.binNames(suffix);
+  const bool reuse = incremental && manifest.getSettings() == settings;
+  if (!reuse) {
+    changed.resize(manifest.size());
+    std::iota(changed.begin(), changed.end(), 0);
+  } else {
+    // Images whose bin file went missing are extracted again too
+    for (size_t i{0}; i < manifest.size(); i++) {
+      if (!serialization.exists(bin_names.at(i)) &&
+          !std::binary_search(changed.begin(), changed.end(), i))
+        changed.emplace_back(i);
+    }
+    std::sort(changed.begin(), changed.end());
+  }
+  manifest.setSettings(settings);
+  manifest.setExtraction(extraction);
+
+  std::vector<fs::path> changed_names;
+  {
+    Memory::Stage stage("extract");
+    for (const auto &i : changed) {
+      sift.detectAndExtract(manifest.imagePath(i));
+      const cv::Mat &descriptor = sift.getDescriptors();
+      serialization.serialize(descriptor, bin_names.at(i)); // Store bin to disk
+      manifest.setDescriptors(i, descriptor.rows);
+      changed_names.emplace_back(bin_names.at(i));
+    }
+    manifest.save();
   }
+  std::cout << changed.size() << " of " << manifest.size()
+            << " images extracted" << std::endl;
 
   CodeBook codebook(data_path);
 
-  // Generate new code book
-  codebook.setNumWords(num_words);
-  codebook.generate(image_ext, suffix);
-
-  // Save codebook to bin_path
-  codebook.save("codebook");
-
-  // Load pre-computed codebook
-  // codebook.load("codebook");
+  // Generate new code book, unless an existing one with the same size can
+  // be reused
+  bool reuse_codebook = reuse && serialization.exists("codebook");
+  if (reuse_codebook) {
+    codebook.load("codebook");
+    const int dims = projection_dims > 0 ? projection_dims : 128;
+    reuse_codebook =
+        codebook.get().rows == num_words && codebook.get().cols == dims &&
+        codebook.getExtraction().hash() == extraction.hash();
+  }
+  if (!reuse_codebook) {
+    codebook.setNumWords(num_words);
+    codebook.setProjectionDims(projection_dims);
+    codebook.setCheckpointInterval(checkpoint_interval);
+    codebook.setSeed(seed);
+    codebook.setLowMemory(low_memory);
+    if (max_samples > 0)
+      codebook.setSampling(Sampler::STRATIFIED, max_samples);
+    codebook.generate(image_ext, suffix);
+
+    // Save codebook to bin_path
+    codebook.save("codebook");
+  }
 
   cv::Mat mycodebook = codebook.get();
 
   HistBook histbook(mycodebook, data_path);
-  histbook.generate(image_ext,
-                    suffix); // Compute histogram for all images in the dataset
+  histbook.setExtraction(codebook.getExtraction());
+  histbook.setProjection(codebook.getProjection());
+  histbook.setLowMemory(low_memory && !incremental);
+  if (reuse_codebook && histbook.loadRaw("histbook"))
+    histbook.update(image_ext, changed_names, suffix);
+  else
+    histbook.generate(image_ext, suffix); // Compute histogram for all images
 
   histbook.save("histbook");
+  if (incremental)
+    histbook.saveRaw("histbook");
+  if (!reuse_codebook)
+    histbook.saveIndex("codebook"); // Reused by HistBook::loadCodeBook
+
+  // Per stage wall time, RSS and structure sizes
+  Memory::Profiler::instance().report(std::cout);
+  auto stats_path = data_path;
+  stats_path /= "memory_stats.json";
+  Memory::Profiler::instance().saveJSON(stats_path);
 
   // Load saved histbook
   // std::map<std::string, std::vector<float>> loaded_histbook =
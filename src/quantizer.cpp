@@ -0,0 +1,97 @@
+#include "quantizer.hpp"
+#include "kmeans.hpp"
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+Quantizer::Quantizer(const cv::Mat &codebook) { build(codebook); }
+
+void Quantizer::build(const cv::Mat &codebook) {
+  this->codebook = codebook;
+  if (codebook.rows < 2) {
+    std::cout << "ERROR: CodeBook needs at least two words" << std::endl;
+    index.reset();
+    return;
+  }
+  index = cv::makePtr<cv::flann::Index>(codebook,
+                                        cv::flann::KDTreeIndexParams(trees));
+}
+
+bool Quantizer::save(const std::filesystem::path &path) const {
+  if (empty()) {
+    std::cout << "ERROR: Index has not been built" << std::endl;
+    return false;
+  }
+  index->save(path.string());
+
+  const uint64_t fingerprint = KMeans::fingerprint(codebook);
+  std::ofstream file(fingerprintPath_(path), std::ios::binary);
+  file.write(reinterpret_cast<const char *>(&fingerprint), sizeof(fingerprint));
+  if (!file) {
+    std::cout << "ERROR: Could not write " << fingerprintPath_(path)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Quantizer::load(const cv::Mat &codebook,
+                     const std::filesystem::path &path) {
+  this->codebook = codebook;
+  index.reset();
+
+  // An index without a matching fingerprint belongs to another codebook and
+  // would return words of that one
+  uint64_t fingerprint{0};
+  std::ifstream file(fingerprintPath_(path), std::ios::binary);
+  file.read(reinterpret_cast<char *>(&fingerprint), sizeof(fingerprint));
+  if (!file || fingerprint != KMeans::fingerprint(codebook))
+    return false;
+
+  index = cv::makePtr<cv::flann::Index>();
+  if (!std::filesystem::exists(path) || !index->load(codebook, path.string())) {
+    index.reset();
+    return false;
+  }
+  return true;
+}
+
+void Quantizer::remove(const std::filesystem::path &path) {
+  std::filesystem::remove(path);
+  std::filesystem::remove(fingerprintPath_(path));
+}
+
+std::filesystem::path
+Quantizer::fingerprintPath_(const std::filesystem::path &path) {
+  auto fingerprint_path = path;
+  fingerprint_path += ".fingerprint";
+  return fingerprint_path;
+}
+
+void Quantizer::match(const cv::Mat &descriptors,
+                      std::vector<cv::DMatch> &matches) const {
+  matches.clear();
+  if (empty() || descriptors.empty())
+    return;
+
+  // Per thread buffers that only grow. knnSearch writes into row views of
+  // them, which it does not reallocate once they are large enough.
+  thread_local cv::Mat indices_buffer, dists_buffer;
+  const int rows = descriptors.rows;
+  if (indices_buffer.rows < rows) {
+    indices_buffer.create(rows, 2, CV_32S);
+    dists_buffer.create(rows, 2, CV_32F);
+  }
+  cv::Mat indices = indices_buffer.rowRange(0, rows);
+  cv::Mat dists = dists_buffer.rowRange(0, rows);
+  index->knnSearch(descriptors, indices, dists, 2, *search_params);
+
+  // Distances are squared L2
+  const float ratio_sqr = ratio_thresh * ratio_thresh;
+  for (int i{0}; i < indices.rows; i++) {
+    const int *idx = indices.ptr<int>(i);
+    const float *dist = dists.ptr<float>(i);
+    if (dist[0] < ratio_sqr * dist[1])
+      matches.emplace_back(i, idx[0], std::sqrt(dist[0]));
+  }
+}
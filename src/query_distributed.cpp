@@ -0,0 +1,308 @@
+#include "histbook.hpp"
+#include "socket.hpp"
+
+#include <cereal/types/string.hpp>
+#include <cereal/types/utility.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Multi-process querying over histbook shards. The histbook is split with
+// HistBook::saveShards and every shard process serves one shard file on its
+// own socket. The coordinator computes the query histogram once, fans it
+// out to all shards and merges the top k they return by score. Shards that
+// do not answer within the timeout are left out and the result is reported
+// as partial; the coordinator reconnects to them on the next query.
+
+namespace {
+
+enum Message : char { SCORE, SCORES, DONE };
+
+using Clock = std::chrono::steady_clock;
+using Scores = std::vector<std::pair<std::string, double>>;
+
+// Waiting for shards to come up vs. for a shard that went away
+const int startup_timeout_ms = 10 * 1000;
+const int reconnect_timeout_ms = 100;
+
+template <class... Args>
+bool sendMessage(Net::Socket &socket, const Message &type,
+                 const Args &...args) {
+  if constexpr (sizeof...(Args) == 0)
+    return socket.send(std::string(1, type));
+  else
+    return socket.send(std::string(1, type) + Net::pack(args...));
+}
+
+fs::path shardSocket(const fs::path &prefix, const int &shard) {
+  auto path = prefix;
+  path += "_" + std::to_string(shard) + ".sock";
+  return path;
+}
+
+std::string shardName(const int &shard) {
+  return "histbook_shard" + std::to_string(shard);
+}
+
+int runSplit(const fs::path &data_path, const int num_shards) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook") || histbook.load("histbook").empty())
+    return 1;
+  histbook.setShards(num_shards);
+  histbook.saveShards("histbook");
+  std::cout << "Split " << histbook.getHistBook().size() << " images into "
+            << num_shards << " shards" << std::endl;
+  return 0;
+}
+
+// Serves one shard until the coordinator sends DONE
+int runShard(const fs::path &socket_prefix, const fs::path &data_path,
+             const int shard) {
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+  auto shard_path = data_path;
+  shard_path /= shardName(shard) + ".txt";
+  if (!fs::exists(shard_path)) {
+    std::cout << "ERROR: No shard file " << shard_path << std::endl;
+    return 1;
+  }
+  // Refused if the shard was split with another codebook
+  if (histbook.load(shardName(shard)).empty())
+    return 1;
+
+  const fs::path socket_path = shardSocket(socket_prefix, shard);
+  Net::Socket server = Net::Socket::listen(socket_path);
+  if (!server.valid())
+    return 1;
+
+  // One coordinator connection at a time. A coordinator that timed out
+  // drops its connection and reconnects, so replies never go stale.
+  while (true) {
+    Net::Socket connection = server.accept();
+    std::string message;
+    while (connection.recv(message) && !message.empty()) {
+      if (message[0] == DONE) {
+        fs::remove(socket_path);
+        return 0;
+      }
+      if (message[0] != SCORE)
+        break;
+      int k = 0;
+      std::vector<int> histogram;
+      Net::unpack(message.substr(1), k, histogram);
+      if (!sendMessage(connection, SCORES, histbook.KNScores(histogram, k)))
+        break;
+    }
+  }
+}
+
+class Coordinator {
+private:
+  fs::path socket_prefix;
+  std::vector<Net::Socket> shards;
+  int timeout_ms;
+
+  void connect_(const int &shard, const int &connect_timeout_ms) {
+    shards.at(shard) = Net::Socket::connect(
+        shardSocket(socket_prefix, shard), connect_timeout_ms);
+  }
+
+public:
+  Coordinator(const fs::path &socket_prefix, const int &num_shards,
+              const int &timeout_ms)
+      : socket_prefix{socket_prefix}, shards(num_shards),
+        timeout_ms{timeout_ms} {
+    for (int shard{0}; shard < num_shards; shard++)
+      connect_(shard, startup_timeout_ms);
+  }
+
+  // Merged k closest images of all shards that answered in time. responded
+  // is the number of those shards.
+  Scores query(const std::vector<int> &histogram, const int &k,
+               int &responded) {
+    std::vector<bool> sent(shards.size(), false);
+    for (size_t shard{0}; shard < shards.size(); shard++) {
+      if (!shards.at(shard).valid())
+        connect_(shard, reconnect_timeout_ms);
+      sent.at(shard) = shards.at(shard).valid() &&
+                       sendMessage(shards.at(shard), SCORE, k, histogram);
+    }
+
+    // Shards score in parallel, so one deadline covers all of them
+    const auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    Scores merged;
+    responded = 0;
+    for (size_t shard{0}; shard < shards.size(); shard++) {
+      const int remaining_ms = std::max<int>(
+          0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                 deadline - Clock::now())
+                 .count());
+      std::string message;
+      if (!sent.at(shard) || !shards.at(shard).recv(message, remaining_ms) ||
+          message.empty() || message[0] != SCORES) {
+        std::cout << "Warning: Shard " << shard << " did not answer"
+                  << std::endl;
+        shards.at(shard).close();
+        continue;
+      }
+      Scores scores;
+      Net::unpack(message.substr(1), scores);
+      // Keeps the sort below a strict weak ordering whatever a shard sent
+      for (auto &score : scores)
+        if (std::isnan(score.second))
+          score.second = 1.0;
+      merged.insert(merged.end(), scores.begin(), scores.end());
+      responded++;
+    }
+
+    // Same order as HistBook's own ranking: distance, then name
+    const size_t num_matches =
+        std::min(merged.size(), static_cast<size_t>(std::max(0, k)));
+    std::partial_sort(merged.begin(), merged.begin() + num_matches,
+                      merged.end(), [](const auto &a, const auto &b) {
+                        return a.second < b.second ||
+                               (a.second == b.second && a.first < b.first);
+                      });
+    merged.resize(num_matches);
+    return merged;
+  }
+
+  // Also reaches shards dropped after a timeout, once they are done with
+  // the request they were working on
+  void shutdown() {
+    for (size_t shard{0}; shard < shards.size(); shard++) {
+      if (!shards.at(shard).valid())
+        connect_(shard, timeout_ms);
+      if (shards.at(shard).valid())
+        sendMessage(shards.at(shard), DONE);
+    }
+  }
+};
+
+// Queries every image through the shards. With verify the merged results
+// are compared against a single process HistBook holding the whole
+// histbook.
+int runCoordinator(const fs::path &socket_prefix, const int num_shards,
+                   const fs::path &data_path,
+                   const std::vector<fs::path> &images, const int k,
+                   const int timeout_ms, const bool verify) {
+  // Query histograms are computed with the codebook's extraction settings
+  HistBook histbook(data_path);
+  if (!histbook.loadCodeBook("codebook"))
+    return 1;
+  if (verify && histbook.load("histbook").empty())
+    return 1;
+
+  Coordinator coordinator(socket_prefix, num_shards, timeout_ms);
+  int result = 0;
+  std::vector<int> histogram;
+  for (const auto &image : images) {
+    histbook.computeHist(image, histogram);
+    auto start = Clock::now();
+    int responded = 0;
+    const Scores scores = coordinator.query(histogram, k, responded);
+    const double ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count();
+
+    std::cout << image.filename().string() << ": " << responded << "/"
+              << num_shards << " shards"
+              << (responded < num_shards ? " (partial)" : "") << ", " << ms
+              << " ms" << std::endl;
+    for (const auto &[name, distance] : scores)
+      std::cout << "  " << name << " " << distance << std::endl;
+
+    if (verify && responded == num_shards &&
+        scores != histbook.KNScores(histogram, k)) {
+      std::cout << "ERROR: Differs from the single process histbook"
+                << std::endl;
+      result = 1;
+    }
+  }
+  coordinator.shutdown();
+  return result;
+}
+
+void usage() {
+  std::cout
+      << "Usage: query_distributed local <data_path> <shards> <k> <image ...>\n"
+         "       query_distributed split <data_path> <shards>\n"
+         "       query_distributed shard <socket_prefix> <data_path> <shard>\n"
+         "       query_distributed coordinator <socket_prefix> <shards> "
+         "<data_path> <k> <timeout_ms> <image ...>"
+      << std::endl;
+}
+
+std::vector<fs::path> imageArgs(int argc, char **argv, const int &first) {
+  std::vector<fs::path> images;
+  for (int i = first; i < argc; i++)
+    images.emplace_back(fs::canonical(argv[i]));
+  return images;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const int timeout_ms = 2000;
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  const std::string mode = argv[1];
+
+  if (mode == "split" && argc == 4)
+    return runSplit(fs::canonical(argv[2]), std::max(1, std::stoi(argv[3])));
+
+  if (mode == "shard" && argc == 5)
+    return runShard(argv[2], fs::canonical(argv[3]), std::stoi(argv[4]));
+
+  if (mode == "coordinator" && argc > 7)
+    return runCoordinator(argv[2], std::stoi(argv[3]), fs::canonical(argv[4]),
+                          imageArgs(argc, argv, 7), std::stoi(argv[5]),
+                          std::stoi(argv[6]), false);
+
+  // Split, then one process per shard and the coordinator on this host,
+  // checking the merged results against a single process
+  if (mode == "local" && argc > 5) {
+    const fs::path data_path = fs::canonical(argv[2]);
+    const int num_shards = std::max(1, std::stoi(argv[3]));
+    if (runSplit(data_path, num_shards) != 0)
+      return 1;
+    const fs::path socket_prefix =
+        fs::temp_directory_path() /
+        ("bovw_query_" + std::to_string(::getpid()));
+
+    std::vector<pid_t> pids;
+    for (int shard{0}; shard < num_shards; shard++) {
+      pid_t pid = ::fork();
+      if (pid == 0)
+        ::_exit(runShard(socket_prefix, data_path, shard));
+      pids.emplace_back(pid);
+    }
+    int result = runCoordinator(socket_prefix, num_shards, data_path,
+                                imageArgs(argc, argv, 5), std::stoi(argv[4]),
+                                timeout_ms, true);
+    for (const auto &pid : pids) {
+      int status = 0;
+      ::waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result = 1;
+    }
+    return result;
+  }
+
+  usage();
+  return 1;
+}
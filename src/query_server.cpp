@@ -0,0 +1,331 @@
+#include "histbook.hpp"
+#include "socket.hpp"
+
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/imgcodecs.hpp>
+
+namespace fs = std::filesystem;
+
+// Resident query daemon. Loads the codebook, quantizer index and histbook
+// once and answers KNMatcher requests over a local socket, so a query no
+// longer pays for loading them. Accepted connections are queued for a pool
+// of worker threads; a worker serves the requests of one connection until
+// the client disconnects or sends nothing for idle_timeout_ms, after which
+// the connection is closed and the worker moves on. Requests carry either
+// encoded image bytes or precomputed descriptors; replies carry the matches
+// and the time spent on the request. If the raw histbook was saved
+// (incremental preprocess), images can also be inserted while queries are
+// being served.
+//
+//   query_server serve <data_path> <socket> [workers]
+//   query_server query <socket> <image> [k]
+//   query_server insert <socket> <image>
+
+namespace {
+
+enum Message : char {
+  QUERY_IMAGE,
+  QUERY_DESCRIPTORS,
+  RESULT,
+  FAILURE,
+  INSERT_DESCRIPTORS,
+  INSERT_IMAGE
+};
+
+using Clock = std::chrono::steady_clock;
+
+const int poll_ms = 500;
+const int reply_timeout_ms = 60 * 1000;
+// Idle connections are closed after this long so they do not hold a worker
+const int idle_timeout_ms = 5 * 1000;
+// Width of the unprojected SIFT descriptors clients send
+const int descriptor_cols = 128;
+
+std::atomic<bool> running{true};
+
+void stop(int) { running = false; }
+
+double elapsedMs(const Clock::time_point &start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+template <class... Args>
+bool sendMessage(Net::Socket &socket, const Message &type,
+                 const Args &...args) {
+  return socket.send(std::string(1, type) + Net::pack(args...));
+}
+
+// Milliseconds spent on one request
+struct Timing {
+  double decode{0.0}, match{0.0}, total{0.0};
+
+  template <class Archive> void serialize(Archive &ar) {
+    ar(decode, match, total);
+  };
+};
+
+class Server {
+private:
+  // Workers share it without locking, inserts publish new versions of it
+  HistBook histbook;
+  bool loaded{false};
+
+  // Answers one request. Returns false if the reply could not be sent.
+  bool handle_(Net::Socket &connection, const std::string &message) {
+    auto start = Clock::now();
+    Timing timing;
+    int k = 0;
+    std::string name;
+    cv::Mat input;
+    const std::string payload = message.substr(1);
+    try {
+      if (message[0] == QUERY_IMAGE || message[0] == INSERT_IMAGE) {
+        std::string bytes;
+        if (message[0] == QUERY_IMAGE)
+          Net::unpack(payload, k, bytes);
+        else
+          Net::unpack(payload, name, bytes);
+        const std::vector<unsigned char> buffer(bytes.begin(), bytes.end());
+        input = cv::imdecode(buffer, histbook.getExtraction().read_flags);
+      } else if (message[0] == QUERY_DESCRIPTORS) {
+        Net::unpack(payload, k, input);
+      } else if (message[0] == INSERT_DESCRIPTORS) {
+        Net::unpack(payload, name, input);
+      } else {
+        return sendMessage(connection, FAILURE,
+                           std::string("Unknown request"));
+      }
+    } catch (const std::exception &e) {
+      return sendMessage(connection, FAILURE,
+                         std::string("Malformed request: ") + e.what());
+    }
+    if (input.empty())
+      return sendMessage(connection, FAILURE, std::string("Empty input"));
+    // Anything else would trip an assertion in the projection or quantizer
+    if ((message[0] == QUERY_DESCRIPTORS || message[0] == INSERT_DESCRIPTORS) &&
+        (input.type() != CV_32F || input.cols != descriptor_cols))
+      return sendMessage(connection, FAILURE,
+                         std::string("Expected CV_32F descriptors with ") +
+                             std::to_string(descriptor_cols) + " columns");
+    timing.decode = elapsedMs(start);
+
+    auto match_start = Clock::now();
+    std::vector<std::string> matches;
+    try {
+      if (message[0] == INSERT_IMAGE)
+        input = histbook.extractDescriptors(input);
+      if (message[0] == INSERT_DESCRIPTORS || message[0] == INSERT_IMAGE) {
+        if (!histbook.insert({{name, input}}))
+          return sendMessage(connection, FAILURE,
+                             std::string("Insert refused, see server log"));
+      } else {
+        matches = message[0] == QUERY_IMAGE
+                      ? histbook.KNMatcher(input, k)
+                      : histbook.KNMatcherDescriptors(input, k);
+      }
+    } catch (const std::exception &e) {
+      return sendMessage(connection, FAILURE,
+                         std::string("Matching failed: ") + e.what());
+    }
+    timing.match = elapsedMs(match_start);
+    timing.total = elapsedMs(start);
+    return sendMessage(connection, RESULT, matches, timing);
+  }
+
+  // Connections accepted but not picked up by a worker yet
+  std::queue<Net::Socket> pending;
+  std::mutex pending_mutex;
+  std::condition_variable pending_cv;
+
+  void work_() {
+    while (running) {
+      Net::Socket connection;
+      {
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        if (!pending_cv.wait_for(lock, std::chrono::milliseconds(poll_ms),
+                                 [this] { return !pending.empty(); }))
+          continue;
+        connection = std::move(pending.front());
+        pending.pop();
+      }
+
+      try {
+        serve_(connection);
+      } catch (const std::exception &e) {
+        std::cout << "ERROR: Dropped a connection: " << e.what() << std::endl;
+      }
+    }
+  }
+
+  // Answers the requests of one connection until it closes, breaks or idles
+  void serve_(Net::Socket &connection) {
+    std::string message;
+    int idle_ms = 0;
+    while (running && idle_ms < idle_timeout_ms) {
+      if (!connection.readable(poll_ms)) {
+        idle_ms += poll_ms;
+        continue;
+      }
+      idle_ms = 0;
+      // Readable but nothing to read means the client disconnected
+      if (!connection.recv(message, reply_timeout_ms) || message.empty() ||
+          !handle_(connection, message))
+        break;
+    }
+  }
+
+public:
+  explicit Server(const fs::path &data_path) : histbook(data_path) {
+    loaded = histbook.loadCodeBook("codebook") &&
+             !histbook.load("histbook").empty();
+    if (loaded && !histbook.loadRaw("histbook"))
+      std::cout << "Warning: No raw histbook, inserts are disabled"
+                << std::endl;
+  }
+
+  // False if the codebook or histbook could not be loaded
+  bool valid() const { return loaded; };
+
+  void serve(const fs::path &socket_path, const int &num_workers) {
+    Net::Socket listener = Net::Socket::listen(socket_path);
+    if (!listener.valid())
+      return;
+    std::cout << "Serving on " << socket_path << " with " << num_workers
+              << " workers" << std::endl;
+
+    std::vector<std::thread> workers;
+    for (int i{0}; i < num_workers; i++)
+      workers.emplace_back(&Server::work_, this);
+    while (running) {
+      Net::Socket connection = listener.accept(poll_ms);
+      if (!connection.valid())
+        continue;
+      {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending.push(std::move(connection));
+      }
+      pending_cv.notify_one();
+    }
+    for (auto &worker : workers)
+      worker.join();
+    fs::remove(socket_path);
+  }
+};
+
+// Sends one request and waits for its reply. Returns false on failure.
+template <class... Args>
+bool request(const fs::path &socket_path, std::string &reply,
+             const Message &type, const Args &...args) {
+  Net::Socket socket = Net::Socket::connect(socket_path);
+  if (!socket.valid() || !sendMessage(socket, type, args...) ||
+      !socket.recv(reply, reply_timeout_ms) || reply.empty())
+    return false;
+  if (reply[0] != RESULT) {
+    std::string error;
+    Net::unpack(reply.substr(1), error);
+    std::cout << "ERROR: " << error << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int query(const fs::path &socket_path, const fs::path &image_path,
+          const int &k) {
+  std::ifstream file(image_path.c_str(), std::ios::binary);
+  if (!file) {
+    std::cout << "ERROR: Could not read " << image_path << std::endl;
+    return 1;
+  }
+  const std::string bytes{std::istreambuf_iterator<char>(file),
+                          std::istreambuf_iterator<char>()};
+
+  std::string reply;
+  if (!request(socket_path, reply, QUERY_IMAGE, k, bytes))
+    return 1;
+  std::vector<std::string> matches;
+  Timing timing;
+  Net::unpack(reply.substr(1), matches, timing);
+  for (const auto &match : matches)
+    std::cout << match << std::endl;
+  std::cout << "decode_ms " << timing.decode << " match_ms " << timing.match
+            << " total_ms " << timing.total << std::endl;
+  return 0;
+}
+
+// Adds the image to the served histbook under the image's stem. The server
+// extracts it with the settings saved with its codebook.
+int insert(const fs::path &socket_path, const fs::path &image_path) {
+  std::ifstream file(image_path.c_str(), std::ios::binary);
+  if (!file) {
+    std::cout << "ERROR: Could not read " << image_path << std::endl;
+    return 1;
+  }
+  const std::string bytes{std::istreambuf_iterator<char>(file),
+                          std::istreambuf_iterator<char>()};
+
+  std::string reply;
+  if (!request(socket_path, reply, INSERT_IMAGE, image_path.stem().string(),
+               bytes))
+    return 1;
+  Timing timing;
+  std::vector<std::string> matches;
+  Net::unpack(reply.substr(1), matches, timing);
+  std::cout << "insert_ms " << timing.match << std::endl;
+  return 0;
+}
+
+void usage() {
+  std::cout << "Usage: query_server serve <data_path> <socket> [workers]\n"
+               "       query_server query <socket> <image> [k]\n"
+               "       query_server insert <socket> <image>"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    usage();
+    return 1;
+  }
+  const std::string mode = argv[1];
+
+  if (mode == "serve") {
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    std::signal(SIGPIPE, SIG_IGN);
+    const int num_workers = argc > 4 ? std::stoi(argv[4]) : 4;
+    Server server(fs::canonical(argv[2]));
+    if (!server.valid())
+      return 1;
+    server.serve(argv[3], std::max(1, num_workers));
+    return 0;
+  }
+
+  if (mode == "query")
+    return query(argv[2], fs::canonical(argv[3]),
+                 argc > 4 ? std::stoi(argv[4]) : 20);
+
+  if (mode == "insert")
+    return insert(argv[2], fs::canonical(argv[3]));
+
+  usage();
+  return 1;
+}
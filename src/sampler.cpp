@@ -0,0 +1,135 @@
+#include "sampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+Sampler::Sampler(const Mode &mode, const int &max_samples,
+                 const uint64_t &seed)
+    : mode{mode}, max_samples{max_samples}, rng{seed} {
+  if (mode != ALL && max_samples <= 0)
+    this->mode = ALL;
+}
+
+void Sampler::store_(const cv::Mat &row, const int &slot) {
+  if (samples.empty())
+    samples.create(max_samples, row.cols, CV_32F);
+  row.convertTo(samples.row(slot), CV_32F);
+}
+
+void Sampler::addUniform_(const cv::Mat &des) {
+  for (int i{0}; i < des.rows; i++, seen++) {
+    if (seen < max_samples) {
+      store_(des.row(i), static_cast<int>(seen));
+      continue;
+    }
+    // Algorithm R: keep the row with probability max_samples / (seen + 1)
+    const auto slot = static_cast<int64_t>(rng.uniform(0.0, 1.0) * (seen + 1));
+    if (slot < max_samples)
+      store_(des.row(i), static_cast<int>(slot));
+  }
+}
+
+void Sampler::addStratified_(const cv::Mat &des) {
+  const int budget = std::max(1, max_samples / num_images);
+  const int take = std::min({budget, des.rows,
+                             max_samples - static_cast<int>(seen)});
+  if (take <= 0)
+    return;
+
+  // Partial Fisher-Yates shuffle picks take distinct rows
+  std::vector<int> order(des.rows);
+  for (int i{0}; i < des.rows; i++)
+    order[i] = i;
+  for (int i{0}; i < take; i++) {
+    std::swap(order[i], order[rng.uniform(i, des.rows)]);
+    store_(des.row(order[i]), static_cast<int>(seen));
+    seen++;
+  }
+}
+
+void Sampler::addToMean(const cv::Mat &des) {
+  if (des.empty())
+    return;
+  cv::Mat rows;
+  des.convertTo(rows, CV_64F);
+  cv::Mat row_sum;
+  cv::reduce(rows, row_sum, 0, cv::REDUCE_SUM, CV_64F);
+  if (sum.empty())
+    sum = row_sum;
+  else
+    sum += row_sum;
+  sum_sqr_norm += rows.dot(rows);
+  mean_count += des.rows;
+}
+
+void Sampler::addCoreset_(const cv::Mat &des) {
+  if (mean.empty()) {
+    if (!mean_count)
+      return;
+    cv::Mat mean64 = sum / static_cast<double>(mean_count);
+    mean64.convertTo(mean, CV_32F);
+    // sum ||x - mu||^2 = sum ||x||^2 - n ||mu||^2
+    total_sqr_dist =
+        std::max(sum_sqr_norm - mean_count * mean64.dot(mean64), 1e-12);
+  }
+
+  for (int i{0}; i < des.rows; i++) {
+    cv::Mat row;
+    des.row(i).convertTo(row, CV_32F);
+    const double dist = cv::norm(row, mean, cv::NORM_L2SQR);
+    const double q =
+        0.5 / mean_count + 0.5 * dist / total_sqr_dist; // sampling probability
+
+    // A-Res: key = u^(1/q), kept in log form
+    const double key = std::log(rng.uniform(1e-300, 1.0)) / q;
+    int slot;
+    if (static_cast<int>(heap.size()) < max_samples) {
+      slot = static_cast<int>(heap.size());
+      sample_weights.push_back(0.0f);
+    } else if (key > heap.top().first) {
+      slot = heap.top().second;
+      heap.pop();
+    } else {
+      continue;
+    }
+    heap.emplace(key, slot);
+    store_(row, slot);
+    sample_weights.at(slot) = static_cast<float>(1.0 / (max_samples * q));
+  }
+  seen += des.rows;
+}
+
+void Sampler::add(const cv::Mat &des) {
+  if (des.empty())
+    return;
+  switch (mode) {
+  case UNIFORM:
+    addUniform_(des);
+    break;
+  case STRATIFIED:
+    addStratified_(des);
+    break;
+  case CORESET:
+    addCoreset_(des);
+    break;
+  case ALL:
+    samples.push_back(des);
+    seen += des.rows;
+    break;
+  }
+}
+
+cv::Mat Sampler::get() const {
+  if (mode == ALL || samples.empty())
+    return samples;
+  int rows = static_cast<int>(std::min<int64_t>(seen, max_samples));
+  if (mode == CORESET)
+    rows = static_cast<int>(heap.size());
+  return samples.rowRange(0, rows);
+}
+
+cv::Mat Sampler::getWeights() const {
+  if (mode != CORESET || sample_weights.empty())
+    return cv::Mat();
+  return cv::Mat(sample_weights, true);
+}
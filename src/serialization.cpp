@@ -1,5 +1,11 @@
 #include "serialization.hpp"
+#include "compression.hpp"
+#include "hash.hpp"
 // #include <boost/filesystem.hpp>
+#include <cereal/types/string.hpp>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include <fstream>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -32,6 +38,63 @@ int Mat::Serialization::validPath_() {
   return valid_path;
 }
 
+namespace {
+
+// Header of encoded bin files. The first field takes the place of the row
+// count of the cereal cv::Mat layout.
+const int encoded_sentinel = -1;
+// 2 added the RootSIFT flag
+const int encoded_version = 2;
+
+// An LZ4 style block decodes to at most about 255 times its size
+const uint64_t max_expansion = 256;
+
+// Number of bytes of a rows x cols Mat of type. Returns false if the header
+// cannot describe a Mat of at most max_bytes, so that a corrupt file is
+// rejected before anything is allocated for it.
+bool matBytes(const int &rows, const int &cols, const int &type,
+              const uint64_t &max_bytes, uint64_t &bytes) {
+  if (rows < 0 || cols < 0 || type < 0 || type > CV_MAT_TYPE_MASK)
+    return false;
+  const uint64_t elem_size = CV_ELEM_SIZE(type);
+  const uint64_t elements = uint64_t(rows) * uint64_t(cols);
+  if (elements && elem_size > max_bytes / elements)
+    return false;
+  bytes = elements * elem_size;
+  return true;
+}
+
+// Converts m to the storage type of the encoding. Returns false if m is to be
+// stored as is.
+bool encode(const cv::Mat &m, const Mat::Serialization::Encoding &encoding,
+            cv::Mat &stored) {
+  if (m.empty())
+    return false;
+  if (encoding == Mat::Serialization::UINT8 && m.depth() != CV_8U) {
+    m.convertTo(stored, CV_MAKETYPE(CV_8U, m.channels()));
+    cv::Mat restored;
+    stored.convertTo(restored, m.type());
+    return cv::norm(m, restored, cv::NORM_INF) == 0.0;
+  }
+  if (encoding == Mat::Serialization::FLOAT16 &&
+      (m.depth() == CV_32F || m.depth() == CV_64F)) {
+    m.convertTo(stored, CV_MAKETYPE(CV_16F, m.channels()));
+    return true;
+  }
+  return false;
+}
+
+} // namespace
+
+bool Mat::Serialization::isEncoded_(std::istream &file) {
+  int rows = 0;
+  file.read(reinterpret_cast<char *>(&rows), sizeof(rows));
+  const bool encoded = file.gcount() == sizeof(rows) && rows < 0;
+  file.clear();
+  file.seekg(0);
+  return encoded;
+}
+
 void Mat::Serialization::serialize(const cv::Mat &m,
                                    const std::filesystem::path &name) {
   auto bin_name = name;
@@ -44,24 +107,66 @@ void Mat::Serialization::serialize(const cv::Mat &m,
 
   std::ofstream file(path.c_str(), std::ios::binary);
   cereal::BinaryOutputArchive ar(file);
-  ar(m);
+  if (encoding == RAW && !compress && !root_sift) {
+    ar(m);
+    return;
+  }
+
+  cv::Mat stored;
+  if (!encode(m, encoding, stored))
+    stored = m.isContinuous() ? m : m.clone();
+  const uint64_t data_size = stored.total() * stored.elemSize();
+  std::string payload =
+      compress ? Compression::compress(stored.data, data_size)
+               : std::string(reinterpret_cast<const char *>(stored.data),
+                             data_size);
+  ar(encoded_sentinel, encoded_version, m.rows, m.cols, m.type(),
+     stored.type(), compress, root_sift, data_size, payload);
+}
+
+uint64_t Mat::Serialization::binSettings(
+    const SIFT::Features::Settings &extraction) const {
+  const int settings[]{encoding, compress, root_sift};
+  return Hash::fnv1a(settings, sizeof(settings), extraction.hash());
+}
+
+void Mat::Serialization::saveExtraction(
+    const SIFT::Features::Settings &settings,
+    const std::filesystem::path &name) const {
+  std::ofstream file(binPath(name).c_str(), std::ios::binary);
+  cereal::BinaryOutputArchive ar(file);
+  ar(settings);
+}
+
+bool Mat::Serialization::loadExtraction(
+    const std::filesystem::path &name,
+    SIFT::Features::Settings &settings) const {
+  std::ifstream file(binPath(name).c_str(), std::ios::binary);
+  if (!file)
+    return false;
+  try {
+    cereal::BinaryInputArchive ar(file);
+    ar(settings);
+  } catch (const std::exception &e) {
+    std::cout << "ERROR: Could not read " << binPath(name) << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+  return true;
 }
 
 void Mat::Serialization::serialize(const std::filesystem::path &name,
                                    const std::string &suffix) {
   // if ext is provided - read all files with given extension
   if (((std::string)name)[0] == '.') {
-    std::vector<cv::String> imnames;
-    auto path = data_path;
-    (path /= "*") += name;
-    cv::glob(path, imnames, false);
-
-    for (int i{0}; i < imnames.size(); i++) {
-      std::filesystem::path filename = imnames.at(i);
-      const cv::Mat image = cv::imread(imnames.at(i), cv::IMREAD_COLOR);
-
-      auto bin_name = ((filename.stem()) += suffix) += ".bin";
-      serialize(image, bin_name);
+    // Images added or changed since the manifest was saved are included
+    Manifest images = manifest(name);
+    images.refresh();
+    images.save();
+    const auto bin_names = images.binNames(suffix);
+    for (size_t i{0}; i < images.size(); i++) {
+      const cv::Mat image = cv::imread(images.imagePath(i), cv::IMREAD_COLOR);
+      serialize(image, bin_names.at(i));
     }
   } else {
     cv::Mat image = cv::imread(name);
@@ -70,8 +175,8 @@ void Mat::Serialization::serialize(const std::filesystem::path &name,
   }
 }
 
-cv::Mat Mat::Serialization::deserialize(const std::filesystem::path &name) {
-  cv::Mat loaded_data;
+std::filesystem::path
+Mat::Serialization::binPath(const std::filesystem::path &name) const {
   auto bin_name = name;
   if (!bin_name.has_extension())
     bin_name += ".bin";
@@ -80,33 +185,143 @@ cv::Mat Mat::Serialization::deserialize(const std::filesystem::path &name) {
 
   auto path = binary_path;
   path /= bin_name;
+  return path;
+}
+
+cv::Mat
+Mat::Serialization::deserialize(const std::filesystem::path &name) const {
+  cv::Mat loaded_data;
+  deserialize(name, loaded_data);
+  return loaded_data;
+}
 
+bool Mat::Serialization::deserialize(const std::filesystem::path &name,
+                                     cv::Mat &mat) const {
+  const auto path = binPath(name);
   std::ifstream file(path.c_str(), std::ios::binary);
+  std::error_code error;
+  const uint64_t file_size = std::filesystem::file_size(path, error);
+  try {
+    if (!file || error)
+      throw std::runtime_error("cannot open file");
+    read_(file, file_size, mat);
+  } catch (const std::exception &e) {
+    std::cout << "ERROR: Could not read " << path << ": " << e.what()
+              << std::endl;
+    mat = cv::Mat();
+    return false;
+  }
+  return true;
+}
+
+void Mat::Serialization::read_(std::istream &file, const uint64_t &file_size,
+                               cv::Mat &mat) {
+  const bool encoded = isEncoded_(file);
   cereal::BinaryInputArchive ar(file);
-  ar(loaded_data);
-  return loaded_data;
+  int rows, cols, type;
+  uint64_t bytes;
+  if (!encoded) {
+    ar(rows, cols, type);
+    const uint64_t remaining = file_size - file.tellg();
+    if (!matBytes(rows, cols, type, remaining, bytes))
+      throw std::runtime_error("corrupt header");
+    file.seekg(0);
+    ar(mat);
+    return;
+  }
+
+  int sentinel, version, stored_type;
+  bool compressed, root_sift{false};
+  uint64_t data_size;
+  cereal::size_type payload_size;
+  ar(sentinel, version);
+  if (version < 1 || version > encoded_version)
+    throw std::runtime_error("unknown version " + std::to_string(version));
+  ar(rows, cols, type, stored_type, compressed);
+  if (version >= 2)
+    ar(root_sift);
+  ar(data_size, cereal::make_size_tag(payload_size));
+
+  // Everything is checked against the file size before allocating
+  const uint64_t remaining = file_size - file.tellg();
+  const uint64_t max_bytes =
+      compressed ? remaining * max_expansion : remaining;
+  if (payload_size > remaining ||
+      !matBytes(rows, cols, stored_type, max_bytes, bytes) ||
+      bytes != data_size || (!compressed && payload_size != data_size) ||
+      !matBytes(rows, cols, type, UINT64_MAX, bytes) ||
+      (root_sift && type != CV_32F))
+    throw std::runtime_error("corrupt header");
+
+  std::string payload(payload_size, '\0');
+  ar(cereal::binary_data(&payload[0], payload_size));
+  cv::Mat stored(rows, cols, stored_type);
+  if (compressed && !Compression::decompress(payload, stored.data, data_size))
+    throw std::runtime_error("corrupt data");
+  if (!compressed && data_size)
+    std::memcpy(stored.data, payload.data(), data_size);
+
+  // Both write in place if mat already has the right size and type
+  if (stored_type == type)
+    stored.copyTo(mat);
+  else
+    stored.convertTo(mat, type);
+  if (root_sift)
+    SIFT::Features::rootSIFT(mat);
+}
+
+bool Mat::Serialization::header(const std::filesystem::path &name, int &rows,
+                                int &cols, int &type) const {
+  const auto path = binPath(name);
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if (!file)
+    return false;
+  const bool encoded = isEncoded_(file);
+  cereal::BinaryInputArchive ar(file);
+  try {
+    if (encoded) {
+      int sentinel, version;
+      ar(sentinel, version);
+      if (version < 1 || version > encoded_version)
+        return false;
+    }
+    ar(rows, cols, type);
+  } catch (const std::exception &) {
+    return false;
+  }
+  uint64_t bytes;
+  return matBytes(rows, cols, type, UINT64_MAX, bytes);
+}
+
+bool Mat::Serialization::exists(const std::filesystem::path &name) const {
+  return std::filesystem::exists(binPath(name));
+}
+
+std::vector<std::filesystem::path>
+Mat::Serialization::binNames(const std::filesystem::path &ext,
+                             const std::string &suffix) {
+  return manifest(ext).binNames(suffix);
+}
+
+Mat::Manifest
+Mat::Serialization::manifest(const std::filesystem::path &ext) const {
+  return Manifest::open(data_path, binary_path, ext.string());
 }
 
 std::vector<cv::Mat>
 Mat::Serialization::deserializeAll(const std::filesystem::path &ext,
                                    const std::string &suffix) {
   std::vector<cv::Mat> loaded_data;
-  // Redundant if statement
+  // The bin folder also holds codebooks, indexes and other state, so only
+  // the bins listed in the saved manifests are read
   if (ext == "") {
-    for (auto &file : std::filesystem::directory_iterator(binary_path))
-      loaded_data.emplace_back(deserialize(file));
+    for (const auto &saved_ext : Manifest::savedExts(binary_path))
+      for (const auto &bin_name : binNames(saved_ext, suffix))
+        loaded_data.push_back(deserialize(bin_name));
 
   } else if (((std::string)ext)[0] == '.') {
-    std::vector<cv::String> imnames;
-    auto path = data_path;
-    (path /= "*") += ext;
-    cv::glob(path, imnames, false);
-
-    for (int i{0}; i < imnames.size(); i++) {
-      std::filesystem::path filename = imnames.at(i);
-      auto bin_path = (filename.stem()) += suffix;
-      loaded_data.push_back(deserialize(bin_path));
-    }
+    for (const auto &bin_name : binNames(ext, suffix))
+      loaded_data.push_back(deserialize(bin_name));
   } else {
     std::cout << "Enter valid extension stating with .";
   }
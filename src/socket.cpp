@@ -0,0 +1,147 @@
+#include "socket.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+bool makeAddress(const std::filesystem::path &path, sockaddr_un &address) {
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  const std::string name = path.string();
+  if (name.size() >= sizeof(address.sun_path)) {
+    std::cout << "ERROR: Socket path too long: " << name << std::endl;
+    return false;
+  }
+  std::strncpy(address.sun_path, name.c_str(), sizeof(address.sun_path) - 1);
+  return true;
+}
+
+bool waitFor(const int &fd, const short &events, const int &timeout_ms) {
+  pollfd request{fd, events, 0};
+  int ready;
+  do {
+    ready = ::poll(&request, 1, timeout_ms);
+  } while (ready < 0 && errno == EINTR);
+  return ready > 0;
+}
+} // namespace
+
+Net::Socket::Socket(Socket &&other) noexcept : fd{other.fd} { other.fd = -1; }
+
+Net::Socket &Net::Socket::operator=(Socket &&other) noexcept {
+  if (this != &other) {
+    close();
+    fd = other.fd;
+    other.fd = -1;
+  }
+  return *this;
+}
+
+Net::Socket::~Socket() { close(); }
+
+void Net::Socket::close() {
+  if (fd >= 0)
+    ::close(fd);
+  fd = -1;
+}
+
+Net::Socket Net::Socket::listen(const std::filesystem::path &path,
+                                const int &backlog) {
+  sockaddr_un address;
+  if (!makeAddress(path, address))
+    return Socket();
+
+  std::filesystem::remove(path);
+  Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+  if (!socket.valid() ||
+      ::bind(socket.fd, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+      ::listen(socket.fd, backlog) < 0) {
+    std::cout << "ERROR: Unable to listen on " << path << ": "
+              << std::strerror(errno) << std::endl;
+    return Socket();
+  }
+  return socket;
+}
+
+Net::Socket Net::Socket::connect(const std::filesystem::path &path,
+                                 const int &timeout_ms) {
+  sockaddr_un address;
+  if (!makeAddress(path, address))
+    return Socket();
+
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(timeout_ms);
+  while (true) {
+    Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if (::connect(socket.fd, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) == 0)
+      return socket;
+    if (std::chrono::steady_clock::now() >= deadline) {
+      std::cout << "ERROR: Unable to connect to " << path << std::endl;
+      return Socket();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+}
+
+Net::Socket Net::Socket::accept(const int &timeout_ms) {
+  if (!waitFor(fd, POLLIN, timeout_ms))
+    return Socket();
+  return Socket(::accept(fd, nullptr, nullptr));
+}
+
+bool Net::Socket::readAll_(char *data, size_t size, const int &timeout_ms) {
+  while (size > 0) {
+    if (!waitFor(fd, POLLIN, timeout_ms))
+      return false;
+    const ssize_t count = ::read(fd, data, size);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+bool Net::Socket::writeAll_(const char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t count = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+bool Net::Socket::send(const std::string &message) {
+  const uint64_t size = message.size();
+  return writeAll_(reinterpret_cast<const char *>(&size), sizeof(size)) &&
+         writeAll_(message.data(), message.size());
+}
+
+bool Net::Socket::recv(std::string &message, const int &timeout_ms) {
+  uint64_t size = 0;
+  if (!readAll_(reinterpret_cast<char *>(&size), sizeof(size), timeout_ms) ||
+      size > max_message_size)
+    return false;
+  message.resize(size);
+  return readAll_(message.data(), size, timeout_ms);
+}
+
+bool Net::Socket::readable(const int &timeout_ms) const {
+  return waitFor(fd, POLLIN, timeout_ms);
+}
@@ -0,0 +1,299 @@
+#include "codebook.hpp"
+#include "kmeans.hpp"
+#include "sampler.hpp"
+#include "serialization.hpp"
+#include "socket.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Multi-process codebook training. Every worker process owns a shard of the
+// bin files (image i belongs to shard i % num_workers) and returns per
+// cluster partial sums for the centers the coordinator broadcasts. The
+// coordinator reduces them in shard order and runs the same Lloyd update as
+// KMeans, so training from the same initial centers gives the codebook
+// single-process KMeans would (see the verify mode).
+
+namespace {
+
+enum Message : char { HELLO, SAMPLE_REQUEST, SAMPLE, CENTERS, STATS, DONE };
+
+const int timeout_ms = 10 * 60 * 1000;
+
+template <class... Args>
+bool sendMessage(Net::Socket &socket, const Message &type,
+                 const Args &...args) {
+  if constexpr (sizeof...(Args) == 0)
+    return socket.send(std::string(1, type));
+  else
+    return socket.send(std::string(1, type) + Net::pack(args...));
+}
+
+// Receives a message and checks its type. payload holds the packed values.
+bool recvMessage(Net::Socket &socket, const Message &type,
+                 std::string &payload) {
+  std::string message;
+  if (!socket.recv(message, timeout_ms) || message.empty() ||
+      message[0] != type)
+    return false;
+  payload = message.substr(1);
+  return true;
+}
+
+KMeans::Params trainingParams(const int &num_words, const uint64_t &seed) {
+  KMeans::Params params;
+  params.num_clusters = num_words;
+  params.seed = seed;
+  params.attempts = 1;
+  return params;
+}
+
+int runWorker(const fs::path &socket_path, const int shard,
+              const int num_shards, const fs::path &data_path,
+              const std::string &image_ext) {
+  Mat::Serialization serialization(data_path);
+  const Mat::Manifest manifest = serialization.manifest(image_ext);
+  const auto bin_names = manifest.binNames();
+  cv::Mat data;
+  for (size_t i = shard; i < bin_names.size(); i += num_shards)
+    data.push_back(serialization.deserialize(bin_names.at(i)));
+  data.convertTo(data, CV_32F);
+
+  Net::Socket socket = Net::Socket::connect(socket_path, timeout_ms);
+  if (!socket.valid() || !sendMessage(socket, HELLO, shard, data.rows,
+                                      manifest.getExtraction()))
+    return 1;
+
+  std::string message;
+  while (socket.recv(message, -1) && !message.empty()) {
+    const std::string payload = message.substr(1);
+    if (message[0] == SAMPLE_REQUEST) {
+      int count;
+      uint64_t seed;
+      Net::unpack(payload, count, seed);
+      Sampler sampler(Sampler::UNIFORM, count, seed);
+      sampler.add(data);
+      sendMessage(socket, SAMPLE, sampler.get().clone());
+    } else if (message[0] == CENTERS) {
+      cv::Mat centers, labels, dists, sums, counts;
+      Net::unpack(payload, centers);
+      double compactness =
+          KMeans::accumulate(data, centers, labels, dists, sums, counts);
+      sendMessage(socket, STATS, sums, counts, compactness);
+    } else if (message[0] == DONE) {
+      return 0;
+    }
+  }
+  std::cout << "ERROR: Worker " << shard << " lost the coordinator"
+            << std::endl;
+  return 1;
+}
+
+int runCoordinator(const fs::path &socket_path, const int num_workers,
+                   const fs::path &data_path, const int num_words,
+                   const uint64_t seed, const int init_samples) {
+  Net::Socket server = Net::Socket::listen(socket_path);
+  if (!server.valid())
+    return 1;
+
+  std::vector<Net::Socket> workers(num_workers);
+  std::vector<int> shard_rows(num_workers, 0);
+  int64_t total_rows = 0;
+  // Saved with the codebook, so queries extract like the training data
+  SIFT::Features::Settings extraction;
+  for (int i{0}; i < num_workers; i++) {
+    Net::Socket connection = server.accept(timeout_ms);
+    std::string payload;
+    int shard = -1, rows = 0;
+    SIFT::Features::Settings worker_extraction;
+    if (connection.valid() && recvMessage(connection, HELLO, payload))
+      Net::unpack(payload, shard, rows, worker_extraction);
+    if (shard < 0 || shard >= num_workers || workers.at(shard).valid()) {
+      std::cout << "ERROR: Invalid worker handshake" << std::endl;
+      return 1;
+    }
+    if (i > 0 && worker_extraction.hash() != extraction.hash()) {
+      std::cout << "ERROR: Workers read bins extracted with other settings"
+                << std::endl;
+      return 1;
+    }
+    extraction = worker_extraction;
+    workers.at(shard) = std::move(connection);
+    shard_rows.at(shard) = rows;
+    total_rows += rows;
+  }
+  std::cout << num_workers << " workers, " << total_rows << " descriptors"
+            << std::endl;
+  if (total_rows < num_words) {
+    std::cout << "ERROR: Fewer descriptors than words" << std::endl;
+    return 1;
+  }
+
+  // Seed the centers on a sample gathered in shard order. Each shard
+  // contributes in proportion to its size, so the sample is uniform over all
+  // descriptors. A count of 0 would make the Sampler keep everything.
+  cv::Mat sample;
+  for (int shard{0}; shard < num_workers; shard++) {
+    const int count = static_cast<int>(std::max<int64_t>(
+        1, int64_t(init_samples) * shard_rows.at(shard) / total_rows));
+    sendMessage(workers.at(shard), SAMPLE_REQUEST, count,
+                KMeans::deriveSeed(seed, shard));
+  }
+  for (auto &worker : workers) {
+    std::string payload;
+    cv::Mat part;
+    if (!recvMessage(worker, SAMPLE, payload))
+      return 1;
+    Net::unpack(payload, part);
+    sample.push_back(part);
+  }
+
+  KMeans::Params params = trainingParams(num_words, seed);
+  cv::Mat centers;
+  KMeans(params).seedCenters(sample, centers);
+  Mat::Serialization serialization(data_path);
+  serialization.serialize(centers, "codebook_init");
+
+  const int max_iter = params.criteria.maxCount;
+  const double epsilon = params.criteria.epsilon * params.criteria.epsilon;
+  bool converged = false;
+  for (int iter{0};; iter++) {
+    for (auto &worker : workers)
+      sendMessage(worker, CENTERS, centers);
+
+    cv::Mat sums, counts;
+    double compactness = 0.0;
+    for (int shard{0}; shard < num_workers; shard++) {
+      std::string payload;
+      cv::Mat shard_sums, shard_counts;
+      double shard_compactness;
+      if (!recvMessage(workers.at(shard), STATS, payload)) {
+        std::cout << "ERROR: Worker " << shard << " did not respond"
+                  << std::endl;
+        return 1;
+      }
+      Net::unpack(payload, shard_sums, shard_counts, shard_compactness);
+      // Shards without images (more workers than images) have no
+      // descriptor columns and add nothing
+      if (shard_sums.empty())
+        continue;
+      if (sums.empty()) {
+        sums = shard_sums;
+        counts = shard_counts;
+      } else {
+        sums += shard_sums;
+        counts += shard_counts;
+      }
+      compactness += shard_compactness;
+    }
+    std::cout << "Iteration " << iter << " compactness " << compactness
+              << std::endl;
+
+    if (iter >= max_iter || converged)
+      break;
+    converged = KMeans::update(sums, counts, centers) <= epsilon;
+  }
+
+  for (auto &worker : workers)
+    sendMessage(worker, DONE);
+
+  CodeBook codebook(centers, data_path);
+  codebook.setExtraction(extraction);
+  codebook.save("codebook");
+  return 0;
+}
+
+// Trains single-process KMeans from the coordinator's initial centers and
+// reports how far the distributed codebook is from it
+int runVerify(const fs::path &data_path, const std::string &image_ext,
+              const int num_words, const uint64_t seed) {
+  Mat::Serialization serialization(data_path);
+  cv::Mat data;
+  for (const auto &mat : serialization.deserializeAll(image_ext))
+    data.push_back(mat);
+
+  KMeans::Params params = trainingParams(num_words, seed);
+  params.initial_centers = serialization.deserialize("codebook_init");
+  cv::Mat labels, centers;
+  KMeans(params).fit(data, labels, centers);
+
+  cv::Mat distributed = serialization.deserialize("codebook");
+  double max_diff = cv::norm(centers, distributed, cv::NORM_INF);
+  std::cout << "Max abs difference to single-process codebook: " << max_diff
+            << std::endl;
+  return max_diff < 1e-3 ? 0 : 1;
+}
+
+void usage() {
+  std::cout
+      << "Usage: train_distributed local <workers> <data_path> <ext> "
+         "<num_words>\n"
+         "       train_distributed coordinator <socket> <workers> <data_path> "
+         "<num_words>\n"
+         "       train_distributed worker <socket> <shard> <workers> "
+         "<data_path> <ext>\n"
+         "       train_distributed verify <data_path> <ext> <num_words>"
+      << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const uint64_t seed = 42;
+  const int init_samples = 200000;
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  const std::string mode = argv[1];
+
+  if (mode == "worker" && argc == 7)
+    return runWorker(argv[2], std::stoi(argv[3]), std::stoi(argv[4]),
+                     fs::canonical(argv[5]), argv[6]);
+
+  if (mode == "coordinator" && argc == 6)
+    return runCoordinator(argv[2], std::stoi(argv[3]), fs::canonical(argv[4]),
+                          std::stoi(argv[5]), seed, init_samples);
+
+  if (mode == "verify" && argc == 5)
+    return runVerify(fs::canonical(argv[2]), argv[3], std::stoi(argv[4]),
+                     seed);
+
+  // Coordinator and workers on this host, one process each
+  if (mode == "local" && argc == 6) {
+    const int num_workers = std::stoi(argv[2]);
+    const fs::path data_path = fs::canonical(argv[3]);
+    const fs::path socket_path =
+        fs::temp_directory_path() /
+        ("bovw_train_" + std::to_string(::getpid()) + ".sock");
+
+    std::vector<pid_t> pids;
+    for (int shard{0}; shard < num_workers; shard++) {
+      pid_t pid = ::fork();
+      if (pid == 0)
+        ::_exit(runWorker(socket_path, shard, num_workers, data_path,
+                          argv[4]));
+      pids.emplace_back(pid);
+    }
+    int result = runCoordinator(socket_path, num_workers, data_path,
+                                std::stoi(argv[5]), seed, init_samples);
+    for (const auto &pid : pids) {
+      int status = 0;
+      ::waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result = 1;
+    }
+    fs::remove(socket_path);
+    return result;
+  }
+
+  usage();
+  return 1;
+}